@@ -0,0 +1,407 @@
+#include "database-myfile-codec.h"
+#include "easylogging++.h"
+#include "util/checksum.h"
+#include <string.h>
+
+#ifdef USE_ZSTD
+# include <zstd.h>
+# include <zdict.h>
+#endif
+#ifdef USE_LZ4
+# include <lz4.h>
+#endif
+
+#ifndef WIN32
+# include <fcntl.h>
+#endif
+
+#define DICTIONARY_MAGIC 0x4349444D  // "MDIC"
+#define MAX_DECODED_LENGTH (16 * 1024 * 1024)
+
+#pragma pack(1)
+
+struct DictionaryRecord
+{
+  uint32_t magic;
+  uint32_t id;
+  uint32_t len;
+  uint32_t crc;
+};
+
+#pragma pack()
+
+BlockCodec::BlockCodec()
+{
+  m_dictfile = nullptr;
+  for (int i = 0; i <= MAX_DICTIONARY_NUM; ++i)
+    m_dicts[i] = nullptr;
+  m_currentDict = 0;
+  m_codec = MC_RAW;
+  m_level = DEFAULT_CODEC_LEVEL;
+  uv_mutex_init(&m_lock);
+}
+
+BlockCodec::~BlockCodec()
+{
+  UnInit();
+  uv_mutex_destroy(&m_lock);
+}
+
+bool BlockCodec::IsSupported(int32_t codec)
+{
+  switch (codec)
+  {
+  case MC_RAW:
+    return true;
+#ifdef USE_LZ4
+  case MC_LZ4:
+    return true;
+#endif
+#ifdef USE_ZSTD
+  case MC_ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+int BlockCodec::Init(const std::string &dictpath)
+{
+  UnInit();
+
+  // the dictionary file is created by the first TrainDictionary
+  m_dictpath = dictpath;
+  if (!fs_system::PathExists(dictpath))
+    return 0;
+
+#ifdef WIN32
+  m_dictfile = new File(dictpath, GENERIC_WRITE | GENERIC_READ);
+#else
+  m_dictfile = new File(dictpath, O_RDWR);
+#endif
+  if (!m_dictfile->IsValid())
+  {
+    LOG(ERROR) << "Unable to open dictionary file: " << dictpath;
+    return -1;
+  }
+
+  // a torn record at the end is left behind the last complete one and overwritten by the next
+  int64_t length = m_dictfile->GetLength();
+  int64_t pos = 0;
+  while (pos + (int64_t)sizeof(DictionaryRecord) <= length)
+  {
+    DictionaryRecord record;
+    if (m_dictfile->Read(pos, (char*)&record, sizeof(record)) != sizeof(record))
+      break;
+    if (record.magic != DICTIONARY_MAGIC || record.id != (uint32_t)m_currentDict + 1
+      || record.len > MAX_DICTIONARY_LENGTH || pos + (int64_t)sizeof(record) + record.len > length)
+      break;
+
+    std::string content(record.len, '\0');
+    if (m_dictfile->Read(pos + sizeof(record), &content[0], record.len) != (int)record.len)
+      break;
+    if (checksum::Compute(CT_CRC32, content.c_str(), content.length()) != record.crc)
+      break;
+
+    m_dicts[record.id] = createDictionary(content);
+    m_currentDict = record.id;
+    pos += sizeof(record) + record.len;
+  }
+  return 0;
+}
+
+void BlockCodec::UnInit()
+{
+  for (int i = 0; i <= MAX_DICTIONARY_NUM; ++i)
+  {
+    freeDictionary(m_dicts[i]);
+    m_dicts[i] = nullptr;
+  }
+  m_currentDict = 0;
+
+#ifdef USE_ZSTD
+  for (size_t i = 0; i < m_zstdCCtx.size(); ++i)
+    ZSTD_freeCCtx((ZSTD_CCtx*)m_zstdCCtx[i]);
+  for (size_t i = 0; i < m_zstdDCtx.size(); ++i)
+    ZSTD_freeDCtx((ZSTD_DCtx*)m_zstdDCtx[i]);
+#endif
+#ifdef USE_LZ4
+  for (size_t i = 0; i < m_lz4Stream.size(); ++i)
+    LZ4_freeStream((LZ4_stream_t*)m_lz4Stream[i]);
+#endif
+  m_zstdCCtx.clear();
+  m_zstdDCtx.clear();
+  m_lz4Stream.clear();
+
+  delete m_dictfile;
+  m_dictfile = nullptr;
+}
+
+void BlockCodec::SetCodec(int32_t codec, int32_t level)
+{
+  if (!IsSupported(codec))
+  {
+    LOG(ERROR) << "codec " << codec << " is not built in, values are stored raw";
+    codec = MC_RAW;
+  }
+  m_level = level;
+  m_codec = codec;
+}
+
+BlockCodec::Dictionary* BlockCodec::createDictionary(const std::string& content)
+{
+  Dictionary* dict = new Dictionary();
+  dict->content = content;
+  dict->cdict = nullptr;
+  dict->ddict = nullptr;
+#ifdef USE_ZSTD
+  // the compression level is bound to the dictionary when it is loaded
+  dict->cdict = ZSTD_createCDict(content.c_str(), content.length(), m_level);
+  dict->ddict = ZSTD_createDDict(content.c_str(), content.length());
+#endif
+  return dict;
+}
+
+void BlockCodec::freeDictionary(Dictionary* dict)
+{
+  if (!dict)
+    return;
+#ifdef USE_ZSTD
+  ZSTD_freeCDict((ZSTD_CDict*)dict->cdict);
+  ZSTD_freeDDict((ZSTD_DDict*)dict->ddict);
+#endif
+  delete dict;
+}
+
+void* BlockCodec::takeContext(std::vector<void*>& pool)
+{
+  uv_mutex_lock(&m_lock);
+  void* ctx = nullptr;
+  if (!pool.empty())
+  {
+    ctx = pool.back();
+    pool.pop_back();
+  }
+  uv_mutex_unlock(&m_lock);
+  if (ctx)
+    return ctx;
+
+#ifdef USE_ZSTD
+  if (&pool == &m_zstdCCtx)
+    return ZSTD_createCCtx();
+  if (&pool == &m_zstdDCtx)
+    return ZSTD_createDCtx();
+#endif
+#ifdef USE_LZ4
+  if (&pool == &m_lz4Stream)
+    return LZ4_createStream();
+#endif
+  return nullptr;
+}
+
+void BlockCodec::giveContext(std::vector<void*>& pool, void* ctx)
+{
+  uv_mutex_lock(&m_lock);
+  pool.push_back(ctx);
+  uv_mutex_unlock(&m_lock);
+}
+
+bool BlockCodec::Compress(const char* src, int len, std::string& dst, uint8_t& codec, uint8_t& dictId)
+{
+  int32_t useCodec = m_codec;
+  if (useCodec == MC_RAW || len == 0)
+    return false;
+
+  int32_t useDict = m_currentDict;
+  Dictionary* dict = useDict > 0 ? m_dicts[useDict].load() : nullptr;
+  int compressed = 0;
+#if !defined(USE_ZSTD) && !defined(USE_LZ4)
+  (void)src;
+#endif
+
+#ifdef USE_ZSTD
+  if (useCodec == MC_ZSTD)
+  {
+    size_t bound = ZSTD_compressBound(len);
+    dst.resize(bound);
+    ZSTD_CCtx* cctx = (ZSTD_CCtx*)takeContext(m_zstdCCtx);
+    if (!cctx)
+      return false;
+    size_t n = dict && dict->cdict
+      ? ZSTD_compress_usingCDict(cctx, &dst[0], bound, src, len, (const ZSTD_CDict*)dict->cdict)
+      : ZSTD_compressCCtx(cctx, &dst[0], bound, src, len, m_level);
+    giveContext(m_zstdCCtx, cctx);
+    if (ZSTD_isError(n))
+      return false;
+    compressed = (int)n;
+  }
+#endif
+#ifdef USE_LZ4
+  if (useCodec == MC_LZ4)
+  {
+    // lz4 blocks do not carry their decoded length
+    int bound = LZ4_compressBound(len);
+    dst.resize(sizeof(uint32_t) + bound);
+    uint32_t rawLen = len;
+    memcpy(&dst[0], &rawLen, sizeof(rawLen));
+    int n = 0;
+    if (dict)
+    {
+      LZ4_stream_t* stream = (LZ4_stream_t*)takeContext(m_lz4Stream);
+      if (!stream)
+        return false;
+      LZ4_loadDict(stream, dict->content.c_str(), (int)dict->content.length());
+      n = LZ4_compress_fast_continue(stream, src, &dst[sizeof(uint32_t)], len, bound, 1);
+      giveContext(m_lz4Stream, stream);
+    }
+    else
+    {
+      n = LZ4_compress_default(src, &dst[sizeof(uint32_t)], len, bound);
+    }
+    if (n <= 0)
+      return false;
+    compressed = (int)sizeof(uint32_t) + n;
+  }
+#endif
+
+  // values that do not shrink are stored raw
+  if (compressed <= 0 || compressed >= len)
+    return false;
+
+  dst.resize(compressed);
+  codec = (uint8_t)useCodec;
+  dictId = (uint8_t)(dict ? useDict : 0);
+  return true;
+}
+
+bool BlockCodec::Decompress(uint8_t codec, uint8_t dictId, const char* src, int len, std::string& dst)
+{
+  if (codec == MC_RAW || codec == MC_LEGACY)
+  {
+    dst.assign(src, len);
+    return true;
+  }
+
+  Dictionary* dict = dictId > 0 ? m_dicts[dictId].load() : nullptr;
+  if (dictId > 0 && !dict)
+  {
+    LOG(ERROR) << "missing dictionary: " << (int)dictId;
+    return false;
+  }
+
+#ifdef USE_ZSTD
+  if (codec == MC_ZSTD)
+  {
+    unsigned long long size = ZSTD_getFrameContentSize(src, len);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > MAX_DECODED_LENGTH)
+      return false;
+    dst.resize(size);
+    ZSTD_DCtx* dctx = (ZSTD_DCtx*)takeContext(m_zstdDCtx);
+    if (!dctx)
+      return false;
+    size_t n = dict && dict->ddict
+      ? ZSTD_decompress_usingDDict(dctx, &dst[0], size, src, len, (const ZSTD_DDict*)dict->ddict)
+      : ZSTD_decompressDCtx(dctx, &dst[0], size, src, len);
+    giveContext(m_zstdDCtx, dctx);
+    return !ZSTD_isError(n) && n == size;
+  }
+#endif
+#ifdef USE_LZ4
+  if (codec == MC_LZ4)
+  {
+    uint32_t rawLen = 0;
+    if (len < (int)sizeof(rawLen))
+      return false;
+    memcpy(&rawLen, src, sizeof(rawLen));
+    if (rawLen > MAX_DECODED_LENGTH)
+      return false;
+    dst.resize(rawLen);
+    const char* block = src + sizeof(rawLen);
+    int blockLen = len - (int)sizeof(rawLen);
+    int n = dict
+      ? LZ4_decompress_safe_usingDict(block, &dst[0], blockLen, rawLen, dict->content.c_str(), (int)dict->content.length())
+      : LZ4_decompress_safe(block, &dst[0], blockLen, rawLen);
+    return n == (int)rawLen;
+  }
+#endif
+
+  LOG(ERROR) << "codec " << (int)codec << " is not built in";
+  return false;
+}
+
+int BlockCodec::TrainDictionary(const std::vector<std::string>& samples, int32_t maxBytes)
+{
+  if (samples.empty() || maxBytes <= 0 || maxBytes > MAX_DICTIONARY_LENGTH)
+    return -1;
+
+  std::string content;
+#ifdef USE_ZSTD
+  std::string buffer;
+  std::vector<size_t> sizes;
+  for (size_t i = 0; i < samples.size(); ++i)
+  {
+    buffer += samples[i];
+    sizes.push_back(samples[i].length());
+  }
+  content.resize(maxBytes);
+  size_t n = ZDICT_trainFromBuffer(&content[0], maxBytes, buffer.c_str(), sizes.data(), (unsigned)sizes.size());
+  if (ZDICT_isError(n))
+  {
+    LOG(ERROR) << "train dictionary fail: " << ZDICT_getErrorName(n);
+    return -1;
+  }
+  content.resize(n);
+#else
+  // without zdict the newest samples form a raw content dictionary
+  for (size_t i = samples.size(); i > 0 && (int32_t)content.length() < maxBytes; --i)
+    content.insert(0, samples[i - 1]);
+  if ((int32_t)content.length() > maxBytes)
+    content.erase(0, content.length() - maxBytes);
+#endif
+
+  uv_mutex_lock(&m_lock);
+  int32_t id = m_currentDict + 1;
+  if (!m_dictfile && !m_dictpath.empty())
+  {
+#ifdef WIN32
+    m_dictfile = new File(m_dictpath, GENERIC_WRITE | GENERIC_READ);
+#else
+    m_dictfile = new File(m_dictpath, O_RDWR);
+#endif
+  }
+  if (!m_dictfile || !m_dictfile->IsValid() || id > MAX_DICTIONARY_NUM)
+  {
+    uv_mutex_unlock(&m_lock);
+    LOG(ERROR) << "can not add dictionary " << id << ": " << m_dictpath;
+    return -1;
+  }
+
+  DictionaryRecord record;
+  record.magic = DICTIONARY_MAGIC;
+  record.id = id;
+  record.len = content.length();
+  record.crc = checksum::Compute(CT_CRC32, content.c_str(), content.length());
+
+  // appended behind the last complete record, it must be durable before a slot names it
+  int64_t pos = 0;
+  for (int32_t i = 1; i < id; ++i)
+    pos += sizeof(DictionaryRecord) + m_dicts[i].load()->content.length();
+  bool ok = m_dictfile->Write(pos, (const char*)&record, sizeof(record)) == sizeof(record)
+    && m_dictfile->Write(pos + sizeof(record), content.c_str(), content.length()) == (int)content.length();
+  m_dictfile->Flush(true);
+  if (ok)
+  {
+    m_dicts[id] = createDictionary(content);
+    m_currentDict = id;
+  }
+  uv_mutex_unlock(&m_lock);
+
+  if (!ok)
+  {
+    LOG(ERROR) << "write dictionary fail, id: " << id;
+    return -1;
+  }
+  LOG(ERROR) << "dictionary " << id << " trained, bytes: " << content.length() << " samples: " << samples.size();
+  return id;
+}
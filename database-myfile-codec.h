@@ -0,0 +1,75 @@
+#ifndef DATABASE_MYFILE_CODEC_HEADER
+#define DATABASE_MYFILE_CODEC_HEADER
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include "util/file_system.h"
+
+// build with USE_ZSTD and/or USE_LZ4 to link the codecs, without them every value is stored raw
+#define MAX_DICTIONARY_NUM 255
+#define MAX_DICTIONARY_LENGTH (1024 * 1024)
+#define DEFAULT_CODEC_LEVEL 3
+
+enum MyfileCodec
+{
+  MC_RAW = 0,
+  MC_LZ4,
+  MC_ZSTD,
+  MC_LEGACY = 0xCD,  // NodeHeader written before the codec byte, stored raw
+};
+
+// compresses block values, optionally against a per-map dictionary. dictionaries live in an
+// append only file and a slot records the one it was compressed with, so training a new
+// dictionary never strands the slots written with an older one.
+class BlockCodec
+{
+public:
+  BlockCodec();
+  ~BlockCodec();
+
+  int Init(const std::string &dictpath);
+  void UnInit();
+
+  // codec and level of new writes, a codec that is not built in stores raw
+  void SetCodec(int32_t codec, int32_t level);
+  int32_t GetCodec() const { return m_codec; }
+  static bool IsSupported(int32_t codec);
+
+  // returns false when the value is better stored raw
+  bool Compress(const char* src, int len, std::string& dst, uint8_t& codec, uint8_t& dictId);
+  bool Decompress(uint8_t codec, uint8_t dictId, const char* src, int len, std::string& dst);
+
+  // trains a dictionary from sample values, appends it to the dictionary file and
+  // compresses new writes with it
+  int TrainDictionary(const std::vector<std::string>& samples, int32_t maxBytes);
+  int32_t GetDictionaryId() const { return m_currentDict; }
+
+private:
+  struct Dictionary
+  {
+    std::string content;
+    void* cdict;  // ZSTD_CDict
+    void* ddict;  // ZSTD_DDict
+  };
+
+  Dictionary* createDictionary(const std::string& content);
+  void freeDictionary(Dictionary* dict);
+
+  void* takeContext(std::vector<void*>& pool);
+  void giveContext(std::vector<void*>& pool, void* ctx);
+
+  std::string m_dictpath;
+  File* m_dictfile;
+  std::atomic<Dictionary*> m_dicts[MAX_DICTIONARY_NUM + 1];  // by id, 0 is no dictionary
+  std::atomic<int32_t> m_currentDict;
+  std::atomic<int32_t> m_codec;
+  std::atomic<int32_t> m_level;
+
+  uv_mutex_t m_lock;  // context pools and dictionary file
+  std::vector<void*> m_zstdCCtx;
+  std::vector<void*> m_zstdDCtx;
+  std::vector<void*> m_lz4Stream;
+};
+
+#endif  //! #ifndef DATABASE_MYFILE_CODEC_HEADER
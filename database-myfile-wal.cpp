@@ -0,0 +1,352 @@
+#include "database-myfile-wal.h"
+#include "easylogging++.h"
+#include "util/checksum.h"
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+#ifndef WIN32
+# include <fcntl.h>
+#endif
+
+#define WAL_SEGMENT_MAGIC 0x4C41574D  // "MWAL"
+#define WAL_RECORD_MAGIC  0x4345524D  // "MREC"
+#define MAX_WAL_VALUE_LENGTH (16 * 1024 * 1024)
+
+#pragma pack(1)
+
+struct WalSegmentHeader
+{
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t sequence;  // 0 while the segment holds no records
+};
+
+// crc covers everything behind it, the value included
+struct WalRecordHeader
+{
+  uint32_t magic;
+  uint32_t len;
+  uint32_t crc;
+  uint8_t  op;
+  uint8_t  reserved[3];
+  uint64_t sequence;  // of the segment, records a previous use left behind do not match it
+  int64_t  pos;
+};
+
+#pragma pack()
+
+static const int CRC_OFFSET = offsetof(WalRecordHeader, op);
+
+MyfileWal::MyfileWal()
+{
+  m_files[0] = m_files[1] = nullptr;
+  m_sequences[0] = m_sequences[1] = 0;
+  m_sequence = 0;
+  m_active = -1;
+  m_writePos = 0;
+  m_appendedCount = 0;
+  m_committedCount = 0;
+  m_committing = false;
+  m_failed = false;
+  m_records = 0;
+  m_commits = 0;
+  m_bytes = 0;
+  m_checkpoints = 0;
+  uv_mutex_init(&m_lock);
+  uv_cond_init(&m_synced);
+}
+
+MyfileWal::~MyfileWal()
+{
+  for (int i = 0; i < 2; ++i)
+    delete m_files[i];
+  uv_cond_destroy(&m_synced);
+  uv_mutex_destroy(&m_lock);
+}
+
+int MyfileWal::Init(const std::string &path, std::vector<MyfileWalRecord>& records)
+{
+  UnInit();
+  m_path = path;
+
+  uint64_t sequences[2] = { 0, 0 };
+  std::vector<MyfileWalRecord> segments[2];
+  for (int i = 0; i < 2; ++i)
+  {
+    if (fs_system::PathExists(m_path + std::to_string(i)))
+      readSegment(i, sequences[i], segments[i]);
+    m_sequence = std::max(m_sequence, sequences[i]);
+  }
+
+  int first = sequences[0] <= sequences[1] ? 0 : 1;
+  for (int i = first; i < first + 2; ++i)
+  {
+    std::vector<MyfileWalRecord>& segment = segments[i % 2];
+    for (size_t r = 0; r < segment.size(); ++r)
+    {
+      records.push_back(MyfileWalRecord());
+      records.back().op = segment[r].op;
+      records.back().pos = segment[r].pos;
+      records.back().value.swap(segment[r].value);
+    }
+  }
+  return 0;
+}
+
+void MyfileWal::readSegment(int32_t segment, uint64_t& sequence, std::vector<MyfileWalRecord>& records)
+{
+  std::string path = m_path + std::to_string(segment);
+#ifdef WIN32
+  File file(path, GENERIC_READ);
+#else
+  File file(path, O_RDONLY);
+#endif
+  WalSegmentHeader header;
+  sequence = 0;
+  if (!file.IsValid() || file.Read(0, (char*)&header, sizeof(header)) != sizeof(header)
+    || header.magic != WAL_SEGMENT_MAGIC || header.sequence == 0)
+    return;
+  sequence = header.sequence;
+
+  int64_t length = file.GetLength();
+  int64_t pos = sizeof(header);
+  std::string buffer;
+  while (pos + (int64_t)sizeof(WalRecordHeader) <= length)
+  {
+    WalRecordHeader record;
+    if (file.Read(pos, (char*)&record, sizeof(record)) != sizeof(record))
+      break;
+    if (record.magic != WAL_RECORD_MAGIC || record.sequence != sequence || record.len > MAX_WAL_VALUE_LENGTH
+      || pos + (int64_t)sizeof(record) + record.len > length)
+      break;
+
+    buffer.assign(sizeof(record) + record.len, '\0');
+    if (file.Read(pos, &buffer[0], buffer.length()) != (int)buffer.length())
+      break;
+    if (checksum::Compute(CT_CRC32C, buffer.c_str() + CRC_OFFSET, buffer.length() - CRC_OFFSET) != record.crc)
+      break;
+
+    records.push_back(MyfileWalRecord());
+    records.back().op = record.op;
+    records.back().pos = record.pos;
+    records.back().value.assign(buffer, sizeof(record), record.len);
+    pos += buffer.length();
+  }
+  LOG(ERROR) << "wal segment " << path << " holds " << records.size() << " records";
+}
+
+bool MyfileWal::openSegment(int32_t segment, uint64_t sequence)
+{
+  if (!m_files[segment])
+  {
+#ifdef WIN32
+    m_files[segment] = new File(m_path + std::to_string(segment), GENERIC_WRITE | GENERIC_READ);
+#else
+    m_files[segment] = new File(m_path + std::to_string(segment), O_RDWR);
+#endif
+  }
+  if (!m_files[segment]->IsValid())
+  {
+    LOG(ERROR) << "Unable to open wal segment: " << m_path << segment;
+    delete m_files[segment];
+    m_files[segment] = nullptr;
+    return false;
+  }
+
+  WalSegmentHeader header;
+  header.magic = WAL_SEGMENT_MAGIC;
+  header.reserved = 0;
+  header.sequence = sequence;
+  if (m_files[segment]->Write(0, (const char*)&header, sizeof(header)) != sizeof(header))
+  {
+    LOG(ERROR) << "wal segment header write fail: " << m_path << segment;
+    return false;
+  }
+  if (!m_files[segment]->Flush(true))
+  {
+    LOG(ERROR) << "wal segment header sync fail: " << m_path << segment;
+    return false;
+  }
+  m_sequences[segment] = sequence;
+  return true;
+}
+
+bool MyfileWal::resetSegment(int32_t segment)
+{
+  if (!m_files[segment] && !fs_system::PathExists(m_path + std::to_string(segment)))
+  {
+    m_sequences[segment] = 0;
+    return true;
+  }
+  return openSegment(segment, 0);
+}
+
+int MyfileWal::Start(bool logging)
+{
+  // a stale segment would be replayed over newer writes after a crash
+  if (!resetSegment(0) || !resetSegment(1))
+    return -1;
+
+  if (!logging)
+  {
+    for (int i = 0; i < 2; ++i)
+    {
+      delete m_files[i];
+      m_files[i] = nullptr;
+      fs_system::DeleteSingleFile(m_path + std::to_string(i));
+    }
+    return 0;
+  }
+
+  // records of an earlier life of a segment carry a smaller sequence, even across restarts
+  uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  m_sequence = std::max(m_sequence + 1, now);
+  if (!openSegment(0, m_sequence))
+    return -1;
+  m_active = 0;
+  m_writePos = sizeof(WalSegmentHeader);
+  m_failed = false;
+  return 0;
+}
+
+void MyfileWal::UnInit()
+{
+  if (m_active >= 0)
+  {
+    resetSegment(0);
+    resetSegment(1);
+  }
+  for (int i = 0; i < 2; ++i)
+  {
+    delete m_files[i];
+    m_files[i] = nullptr;
+    if (m_active >= 0)
+      fs_system::DeleteSingleFile(m_path + std::to_string(i));
+  }
+  m_active = -1;
+  m_pending.clear();
+}
+
+void MyfileWal::encode(std::string& buffer, uint8_t op, int64_t pos, const char* data, int len)
+{
+  size_t offset = buffer.length();
+  buffer.resize(offset + sizeof(WalRecordHeader) + len);
+  WalRecordHeader* record = (WalRecordHeader*)&buffer[offset];
+  record->magic = WAL_RECORD_MAGIC;
+  record->len = len;
+  record->op = op;
+  memset(record->reserved, 0, sizeof(record->reserved));
+  // Rotate never runs during an append, the active segment is stable
+  record->sequence = m_sequences[m_active];
+  record->pos = pos;
+  if (len > 0)
+    memcpy(&buffer[offset + sizeof(WalRecordHeader)], data, len);
+  record->crc = checksum::Compute(CT_CRC32C, &buffer[offset + CRC_OFFSET], sizeof(WalRecordHeader) + len - CRC_OFFSET);
+}
+
+bool MyfileWal::Append(uint8_t op, int64_t pos, const char* data, int len)
+{
+  if (m_active < 0)
+    return false;
+  std::string buffer;
+  encode(buffer, op, pos, data, len);
+  return commit(buffer, 1);
+}
+
+bool MyfileWal::Append(uint8_t op, const std::vector<std::pair<int64_t, std::string>>& blocks)
+{
+  if (m_active < 0)
+    return false;
+  std::string buffer;
+  for (size_t i = 0; i < blocks.size(); ++i)
+    encode(buffer, op, blocks[i].first, blocks[i].second.c_str(), blocks[i].second.length());
+  return commit(buffer, blocks.size());
+}
+
+bool MyfileWal::commit(const std::string& records, int64_t count)
+{
+  uv_mutex_lock(&m_lock);
+  if (m_failed)
+  {
+    uv_mutex_unlock(&m_lock);
+    return false;
+  }
+  m_pending.append(records);
+  int64_t ticket = ++m_appendedCount;
+  m_records += count;
+
+  while (m_committedCount < ticket)
+  {
+    if (m_committing)
+    {
+      uv_cond_wait(&m_synced, &m_lock);
+      continue;
+    }
+
+    // the first waiter commits everything appended so far, the others ride along
+    m_committing = true;
+    std::string batch;
+    batch.swap(m_pending);
+    int64_t last = m_appendedCount;
+    File* file = m_files[m_active];
+    int64_t writePos = m_writePos;
+    m_writePos += batch.length();
+    uv_mutex_unlock(&m_lock);
+
+    // a record is committed only once its fdatasync succeeded
+    bool ok = file->Write(writePos, batch.c_str(), batch.length()) == (int)batch.length()
+      && file->Flush(true);
+
+    uv_mutex_lock(&m_lock);
+    if (!ok)
+    {
+      LOG(ERROR) << "wal write or sync fail: " << m_path << m_active;
+      m_failed = true;
+    }
+    m_committedCount = last;
+    m_committing = false;
+    ++m_commits;
+    m_bytes += batch.length();
+    uv_cond_broadcast(&m_synced);
+  }
+  bool ret = !m_failed;
+  uv_mutex_unlock(&m_lock);
+  return ret;
+}
+
+int32_t MyfileWal::Rotate()
+{
+  uv_mutex_lock(&m_lock);
+  int32_t old = m_active;
+  int32_t next = 1 - m_active;
+  // the other segment still waits for a flush, keep appending to this one
+  if (old < 0 || m_sequences[next] != 0 || !openSegment(next, ++m_sequence))
+  {
+    uv_mutex_unlock(&m_lock);
+    return -1;
+  }
+  m_active = next;
+  m_writePos = sizeof(WalSegmentHeader);
+  uv_mutex_unlock(&m_lock);
+  return old;
+}
+
+void MyfileWal::Release(int32_t segment)
+{
+  if (segment < 0)
+    return;
+  uv_mutex_lock(&m_lock);
+  if (segment != m_active && resetSegment(segment))
+    ++m_checkpoints;
+  uv_mutex_unlock(&m_lock);
+}
+
+void MyfileWal::GetStats(MyfileWalStats& stats)
+{
+  stats.records = m_records;
+  stats.commits = m_commits;
+  stats.bytes = m_bytes;
+  stats.checkpoints = m_checkpoints;
+}
@@ -0,0 +1,93 @@
+#ifndef DATABASE_MYFILE_WAL_HEADER
+#define DATABASE_MYFILE_WAL_HEADER
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include "util/file_system.h"
+
+enum MyfileWalOp
+{
+  WO_SAVE = 0,
+  WO_SAVE_CHANGED,
+  WO_DELETE,
+};
+
+struct MyfileWalRecord
+{
+  uint8_t op;    // MyfileWalOp
+  int64_t pos;   // global block index
+  std::string value;
+};
+
+struct MyfileWalStats
+{
+  int64_t records;
+  int64_t commits;  // write and fdatasync rounds, each covers every record appended while the previous one ran
+  int64_t bytes;
+  int64_t checkpoints;
+};
+
+// write ahead log of a map. block writes are appended to one of two segment files and are durable
+// once Append returns, concurrent appends are grouped into a single write and fdatasync. the
+// partitions only reach the disk at the next flush, a checkpoint rotates to the other segment and
+// releases the old one once the partitions are flushed.
+class MyfileWal
+{
+public:
+  MyfileWal();
+  ~MyfileWal();
+
+  // reads the records a previous run left in the segments at path, oldest first. the records of a
+  // segment end at the first torn one.
+  int Init(const std::string &path, std::vector<MyfileWalRecord>& records);
+  // drops the replayed segments and, when logging, opens an empty one. the records returned by
+  // Init must be flushed to the partitions before.
+  int Start(bool logging);
+  // clean shutdown, the partitions are flushed
+  void UnInit();
+
+  bool IsLogging() const { return m_active >= 0; }
+
+  // returns once the record is durable
+  bool Append(uint8_t op, int64_t pos, const char* data, int len);
+  // one record per block, committed together
+  bool Append(uint8_t op, const std::vector<std::pair<int64_t, std::string>>& blocks);
+
+  // switches appends to the other segment and returns the previous one, -1 when not logging.
+  // no Append may run concurrently.
+  int32_t Rotate();
+  // the partitions are flushed past every record of segment
+  void Release(int32_t segment);
+
+  void GetStats(MyfileWalStats& stats);
+
+private:
+  void encode(std::string& buffer, uint8_t op, int64_t pos, const char* data, int len);
+  bool commit(const std::string& records, int64_t count);
+  bool openSegment(int32_t segment, uint64_t sequence);
+  bool resetSegment(int32_t segment);
+  void readSegment(int32_t segment, uint64_t& sequence, std::vector<MyfileWalRecord>& records);
+
+  std::string m_path;
+  File* m_files[2];
+  uint64_t m_sequences[2];  // of the records in each segment, 0 when it holds none
+  uint64_t m_sequence;      // last one handed out
+  int32_t m_active;         // segment of new appends, -1 when not logging
+  int64_t m_writePos;
+
+  uv_mutex_t m_lock;
+  uv_cond_t m_synced;
+  std::string m_pending;     // records waiting for the next commit
+  int64_t m_appendedCount;   // appends queued and committed, the waiters compare them
+  int64_t m_committedCount;
+  bool m_committing;
+  bool m_failed;
+
+  std::atomic<int64_t> m_records;
+  std::atomic<int64_t> m_commits;
+  std::atomic<int64_t> m_bytes;
+  std::atomic<int64_t> m_checkpoints;
+};
+
+#endif  //! #ifndef DATABASE_MYFILE_WAL_HEADER
@@ -1,7 +1,9 @@
 #include "database-myfile.h"
 #include "easylogging++.h"
-#include "boost/crc.hpp"
+#include "util/checksum.h"
 #include <thread>
+#include <chrono>
+#include <algorithm>
 #include <time.h>
 
 #ifndef WIN32
@@ -68,7 +70,8 @@ CacheValueHandle CacheValueAllocator::alloc()
     return INVALID_HANDLE;
   }
 
-  m_alloced[h] = v;
+  // hits without the lock look the value up by handle
+  __atomic_store_n(&m_alloced[h], v, __ATOMIC_RELEASE);
   return h;
 }
 
@@ -80,9 +83,9 @@ void CacheValueAllocator::free(CacheValueHandle h)
   std::pair<CacheValueHandle, CacheValue*> pair;
   pair.first = h;
   pair.second = m_alloced[h];
-  assert(pair.second->refcount == 0);
+  assert(pair.second->queue == CQ_NONE);
   m_freelist.push_back(pair);
-  m_alloced[h] = 0;
+  __atomic_store_n(&m_alloced[h], (CacheValue*)nullptr, __ATOMIC_RELEASE);
 }
 
 CacheValue* CacheValueAllocator::getValue(CacheValueHandle h)
@@ -90,12 +93,389 @@ CacheValue* CacheValueAllocator::getValue(CacheValueHandle h)
   if (h >= MAX_CACHE)
     return nullptr;
 
-  return m_alloced[h];
+  return __atomic_load_n(&m_alloced[h], __ATOMIC_ACQUIRE);
+}
+
+void CacheQueue::PushFront(CacheValue* value, uint8_t kind)
+{
+  value->queue = kind;
+  value->prev = nullptr;
+  value->next = head;
+  if (head)
+    head->prev = value;
+  else
+    tail = value;
+  head = value;
+  ++count;
+}
+
+void CacheQueue::Remove(CacheValue* value)
+{
+  if (value->prev)
+    value->prev->next = value->next;
+  else
+    head = value->next;
+  if (value->next)
+    value->next->prev = value->prev;
+  else
+    tail = value->prev;
+  value->prev = value->next = nullptr;
+  value->queue = CQ_NONE;
+  --count;
+}
+
+FreeSlotAllocator::FreeSlotAllocator()
+{
+  m_freeBytes = 0;
+}
+
+void FreeSlotAllocator::clear()
+{
+  m_holes.clear();
+  for (int i = 0; i < FREE_SLOT_CLASS_NUM; ++i)
+    m_classes[i].clear();
+  m_freeBytes = 0;
+}
+
+int FreeSlotAllocator::classOf(int32_t capacity) const
+{
+  return std::min(capacity / 1024, FREE_SLOT_CLASS_NUM - 1);
+}
+
+void FreeSlotAllocator::insert(int64_t pos, int32_t capacity)
+{
+  m_holes[pos] = capacity;
+  m_classes[classOf(capacity)].insert(pos);
+  m_freeBytes += capacity;
+}
+
+void FreeSlotAllocator::erase(int64_t pos, int32_t capacity)
+{
+  m_holes.erase(pos);
+  m_classes[classOf(capacity)].erase(pos);
+  m_freeBytes -= capacity;
+}
+
+void FreeSlotAllocator::release(int64_t pos, int32_t capacity)
+{
+  if (capacity <= 0)
+    return;
+
+  // merge with the neighbour holes, so freed runs can serve larger slots
+  auto next = m_holes.lower_bound(pos);
+  if (next != m_holes.begin())
+  {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == pos)
+    {
+      pos = prev->first;
+      capacity += prev->second;
+      erase(prev->first, prev->second);
+    }
+  }
+
+  next = m_holes.find(pos + capacity);
+  if (next != m_holes.end())
+  {
+    int32_t nextCapacity = next->second;
+    erase(next->first, nextCapacity);
+    capacity += nextCapacity;
+  }
+
+  insert(pos, capacity);
+}
+
+int64_t FreeSlotAllocator::alloc(int32_t capacity, int64_t hint)
+{
+  for (int c = classOf(capacity); c < FREE_SLOT_CLASS_NUM; ++c)
+  {
+    std::set<int64_t>& holes = m_classes[c];
+    if (holes.empty())
+      continue;
+
+    // the nearest hole around hint keeps the slot close to its neighbours
+    auto best = holes.end();
+    auto it = holes.lower_bound(hint);
+    for (int k = 0; k < 2 && it != holes.end(); ++k, ++it)
+    {
+      if (m_holes[*it] >= capacity && (best == holes.end() || llabs(*it - hint) < llabs(*best - hint)))
+        best = it;
+    }
+    it = holes.lower_bound(hint);
+    for (int k = 0; k < 2 && it != holes.begin(); ++k)
+    {
+      --it;
+      if (m_holes[*it] >= capacity && (best == holes.end() || llabs(*it - hint) < llabs(*best - hint)))
+        best = it;
+    }
+    if (best == holes.end())
+    {
+      // only the last class mixes sizes, fall back to a full scan there
+      for (it = holes.begin(); it != holes.end() && m_holes[*it] < capacity; ++it);
+      if (it == holes.end())
+        continue;
+      best = it;
+    }
+
+    int64_t pos = *best;
+    int32_t holeCapacity = m_holes[pos];
+    erase(pos, holeCapacity);
+    if (holeCapacity > capacity)
+      insert(pos + capacity, holeCapacity - capacity);
+    return pos;
+  }
+  return -1;
+}
+
+// x % shardCount, the local column of x is floor(x / shardCount)
+class XModShardFunction : public MyfileShardFunction
+{
+public:
+  XModShardFunction(int32_t shardCount) : MyfileShardFunction(shardCount) {}
+
+  int32_t getPolicy() const override { return MSP_XMOD; }
+
+  int32_t getShard(int16_t x, int16_t, int16_t) const override
+  {
+    return abs(x % m_shardCount);
+  }
+
+  bool toLocal(int16_t x, int16_t y, int16_t z, int32_t& ux, int32_t& uy, int32_t& uz) const override
+  {
+    int32_t local_x = x >= 0 ? x / m_shardCount : (x - (m_shardCount - 1)) / m_shardCount;
+    ux = local_x + 2048;
+    uy = y + 2048;
+    uz = z + 2048;
+    return ux >= 0 && ux < 4096 && uy >= 0 && uy < 4096 && uz >= 0 && uz < 4096;
+  }
+
+  void toGlobal(int32_t shard, int32_t ux, int32_t uy, int32_t uz, int32_t& x, int32_t& y, int32_t& z) const override
+  {
+    int32_t local_x = ux - 2048;
+    // the shard of a negative x is -(x % shardCount)
+    if (local_x >= 0 || shard == 0)
+      x = local_x * m_shardCount + shard;
+    else
+      x = (local_x + 1) * m_shardCount - shard;
+    y = uy - 2048;
+    z = uz - 2048;
+  }
+};
+
+#define SHARD_BRICK_BITS 3
+#define SHARD_CODE_MASK ((1u << 27) - 1)  // 9 bits of brick per axis
+
+static uint32_t SpreadBits(uint32_t v)
+{
+  v &= 0x1FF;
+  v = (v | (v << 16)) & 0x030000FF;
+  v = (v | (v << 8)) & 0x0300F00F;
+  v = (v | (v << 4)) & 0x030C30C3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+static uint32_t CompactBits(uint32_t v)
+{
+  v &= 0x09249249;
+  v = (v ^ (v >> 2)) & 0x030C30C3;
+  v = (v ^ (v >> 4)) & 0x0300F00F;
+  v = (v ^ (v >> 8)) & 0xFF0000FF;
+  v = (v ^ (v >> 16)) & 0x000003FF;
+  return v;
+}
+
+static uint64_t SpreadBits12(uint32_t v)
+{
+  uint64_t x = v & 0xFFF;
+  x = (x | (x << 16)) & 0x00000000FF0000FFull;
+  x = (x | (x << 8)) & 0x000000F00F00F00Full;
+  x = (x | (x << 4)) & 0x00000C30C30C30C3ull;
+  x = (x | (x << 2)) & 0x0000249249249249ull;
+  return x;
+}
+
+static uint32_t CompactBits12(uint64_t x)
+{
+  x &= 0x0000249249249249ull;
+  x = (x ^ (x >> 2)) & 0x00000C30C30C30C3ull;
+  x = (x ^ (x >> 4)) & 0x000000F00F00F00Full;
+  x = (x ^ (x >> 8)) & 0x00000000FF0000FFull;
+  x = (x ^ (x >> 16)) & 0x0000000000000FFFull;
+  return (uint32_t)x;
+}
+
+// the bricks of a shard are renumbered densely by code / shardCount, so the index pages of
+// every partition stay as full as with MSP_XMOD
+class MortonShardFunction : public MyfileShardFunction
+{
+public:
+  MortonShardFunction(int32_t shardCount) : MyfileShardFunction(shardCount) {}
+
+  int32_t getPolicy() const override { return MSP_MORTON; }
+
+  int32_t getShard(int16_t x, int16_t y, int16_t z) const override
+  {
+    uint32_t code = 0;
+    if (!brickCode(x, y, z, code))
+      return 0;
+    return scatter(code) % m_shardCount;
+  }
+
+  bool toLocal(int16_t x, int16_t y, int16_t z, int32_t& ux, int32_t& uy, int32_t& uz) const override
+  {
+    uint32_t code = 0;
+    if (!brickCode(x, y, z, code))
+      return false;
+    uint32_t local = scatter(code) / m_shardCount;
+    const int32_t inner = (1 << SHARD_BRICK_BITS) - 1;
+    ux = (CompactBits(local >> 1) << SHARD_BRICK_BITS) | ((x + 2048) & inner);
+    uy = (CompactBits(local >> 2) << SHARD_BRICK_BITS) | ((y + 2048) & inner);
+    uz = (CompactBits(local) << SHARD_BRICK_BITS) | ((z + 2048) & inner);
+    return true;
+  }
+
+  void toGlobal(int32_t shard, int32_t ux, int32_t uy, int32_t uz, int32_t& x, int32_t& y, int32_t& z) const override
+  {
+    uint32_t local = SpreadBits(uz >> SHARD_BRICK_BITS) | (SpreadBits(ux >> SHARD_BRICK_BITS) << 1) | (SpreadBits(uy >> SHARD_BRICK_BITS) << 2);
+    uint32_t code = gather((local * m_shardCount + shard) & SHARD_CODE_MASK);
+    const int32_t inner = (1 << SHARD_BRICK_BITS) - 1;
+    x = ((CompactBits(code >> 1) << SHARD_BRICK_BITS) | (ux & inner)) - 2048;
+    y = ((CompactBits(code >> 2) << SHARD_BRICK_BITS) | (uy & inner)) - 2048;
+    z = ((CompactBits(code) << SHARD_BRICK_BITS) | (uz & inner)) - 2048;
+  }
+
+protected:
+  // bijections of the 27 bit brick code
+  virtual uint32_t scatter(uint32_t code) const { return code; }
+  virtual uint32_t gather(uint32_t code) const { return code; }
+
+private:
+  static bool brickCode(int16_t x, int16_t y, int16_t z, uint32_t& code)
+  {
+    int32_t ux = x + 2048;
+    int32_t uy = y + 2048;
+    int32_t uz = z + 2048;
+    if (ux < 0 || ux >= 4096 || uy < 0 || uy >= 4096 || uz < 0 || uz >= 4096)
+      return false;
+    code = SpreadBits(uz >> SHARD_BRICK_BITS) | (SpreadBits(ux >> SHARD_BRICK_BITS) << 1) | (SpreadBits(uy >> SHARD_BRICK_BITS) << 2);
+    return true;
+  }
+};
+
+// multiply, xorshift, multiply on 27 bits, neighbouring bricks land on unrelated shards
+class HashShardFunction : public MortonShardFunction
+{
+public:
+  HashShardFunction(int32_t shardCount) : MortonShardFunction(shardCount)
+  {
+    m_inverse1 = inverseOdd(MULTIPLIER1);
+    m_inverse2 = inverseOdd(MULTIPLIER2);
+  }
+
+  int32_t getPolicy() const override { return MSP_HASH; }
+
+protected:
+  uint32_t scatter(uint32_t code) const override
+  {
+    code = (code * MULTIPLIER1) & SHARD_CODE_MASK;
+    code ^= code >> 14;
+    return (code * MULTIPLIER2) & SHARD_CODE_MASK;
+  }
+
+  uint32_t gather(uint32_t code) const override
+  {
+    code = (code * m_inverse2) & SHARD_CODE_MASK;
+    code ^= code >> 14;
+    return (code * m_inverse1) & SHARD_CODE_MASK;
+  }
+
+private:
+  static uint32_t inverseOdd(uint32_t a)
+  {
+    uint32_t x = a;  // newton iteration, correct to 3 bits and doubling each step
+    for (int i = 0; i < 5; ++i)
+      x *= 2 - a * x;
+    return x;
+  }
+
+  static const uint32_t MULTIPLIER1 = 0x2C1B3C6D;
+  static const uint32_t MULTIPLIER2 = 0x297A2D39;
+  uint32_t m_inverse1;
+  uint32_t m_inverse2;
+};
+
+MyfileShardFunction* MyfileShardFunction::Create(int32_t policy, int32_t shardCount)
+{
+  if (shardCount <= 0 || shardCount > MAX_PARTITION_NUM)
+    return nullptr;
+
+  switch (policy)
+  {
+  case MSP_XMOD:
+    return new XModShardFunction(shardCount);
+  case MSP_MORTON:
+    return new MortonShardFunction(shardCount);
+  case MSP_HASH:
+    return new HashShardFunction(shardCount);
+  default:
+    return nullptr;
+  }
+}
+
+static void* MapFileRegion(File* file, int64_t offset, int64_t bytes, bool writable)
+{
+#ifdef WIN32
+  int64_t end = offset + bytes;
+  HANDLE mapping = CreateFileMapping(file->file_, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+    (DWORD)(end >> 32), (DWORD)end, NULL);
+  if (mapping == NULL)
+    return nullptr;
+  void* p = MapViewOfFile(mapping, writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ,
+    (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)bytes);
+  CloseHandle(mapping);  // the view keeps the mapping alive
+  return p;
+#else
+  void* p = mmap(0, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file->file_, offset);
+  return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+static void SyncFileRegion(void* p, int64_t bytes)
+{
+#ifdef WIN32
+  BOOL b = FlushViewOfFile(p, bytes);
+  if (!b)
+    LOG(ERROR) << "FlushViewOfFile error!";
+#else
+  // dirty ranges may be finer than the system page
+  static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+  char* begin = (char*)((uintptr_t)p / pageSize * pageSize);
+  msync(begin, bytes + ((char*)p - begin), MS_SYNC);
+#endif
+}
+
+static void UnmapFileRegion(void* p, int64_t bytes)
+{
+#ifdef WIN32
+  UnmapViewOfFile(p);
+#else
+  munmap(p, bytes);
+#endif
+}
+
+// key of m_sharedContent, the crc covers the stored bytes of the slot
+static uint64_t SharedContentKey(uint32_t crc, int len)
+{
+  return ((uint64_t)crc << 16) | (uint16_t)len;
 }
 
 MyfilePartition::MyfilePartition()
+  : m_cacheSketch(MAX_CACHE)
 {
   m_index = 0;
+  m_shardFunction = nullptr;
+  m_codec = nullptr;
   m_cacheMode = CM_CACHE;
   m_cacheNodeCount = 0;
   m_cacheMemoryByte = 0;
@@ -103,40 +483,117 @@ MyfilePartition::MyfilePartition()
   m_metafile = nullptr;
   m_header = NULL;
   m_buffer = NULL;
-  m_node = NULL;
+  m_ring = nullptr;
+  m_directfile = nullptr;
+  m_directIO = false;
+  m_mappedReads = false;
+  m_dataMap = nullptr;
+  m_dataMapBytes = 0;
+  m_dataMapLength = 0;
+  memset(m_pageDir, 0, sizeof(m_pageDir));
+  m_headerDirty = 0;
   m_metadataChanged = false;
-#ifdef WIN32
-  m_hFileMapping = INVALID_HANDLE_VALUE;
-#endif
+  m_liveBytes = 0;
+  m_dataGeneration = 0;
+  m_checksum = CT_CRC32;
+  m_lazyVerify = true;
+  m_logged = false;
+  m_dedup = false;
+  m_nextExtentId = 0;
+  m_dedupHits = 0;
+  m_compacting = false;
+  m_compactCopied = 0;
+  m_compactTotal = 0;
+  m_readCount = 0;
+  m_writeCount = 0;
+  m_writeRuns = 0;
+  m_readRuns = 0;
+  m_appendPos = 0;
+  m_missCount = 0;
+  m_lockWaitCount = 0;
+  m_scrubSlots = 0;
+  m_scrubBytes = 0;
+  m_scrubBadSlots = 0;
   uv_mutex_init(&m_fileLock);
+  uv_rwlock_init(&m_swapLock);
+  uv_mutex_init(&m_ringLock);
 }
 
 MyfilePartition::~MyfilePartition()
 {
+  uv_mutex_destroy(&m_ringLock);
+  uv_rwlock_destroy(&m_swapLock);
   uv_mutex_destroy(&m_fileLock);
 }
 
-int MyfilePartition::Init(const std::string &savedir, const std::string &dbfile, int i, CacheMode cacheMode)
+// loadBlock reads up to two 4K rounded slot capacities, shifted by up to a page under O_DIRECT
+static const int READ_BUFFER_BYTES = ROUND(MAX_DATA_LENGTH, 4096 * 2) + DIRECT_IO_ALIGN;
+
+std::string MyfilePartition::GetDataPath(const std::string &savedir, const std::string &dbfile, int i)
+{
+  char filename[1024] = { 0 };
+#ifdef WIN32
+  sprintf_s(filename, 1024, dbfile.c_str(), i);
+#else
+  snprintf(filename, 1024, dbfile.c_str(), i);
+#endif
+  return savedir + DIR_DELIM + filename;
+}
+
+bool MyfilePartition::ReadShardConfig(const std::string &metapath, int32_t& shardCount, int32_t& shardPolicy)
+{
+  if (!fs_system::PathExists(metapath))
+    return false;
+
+#ifdef WIN32
+  File metafile(metapath, GENERIC_READ);
+#else
+  File metafile(metapath, O_RDONLY);
+#endif
+  char buffer[offsetof(MyfileHeader, reserved)] = { 0 };
+  if (metafile.Read(0, buffer, sizeof(buffer)) <= 0)
+    return false;
+
+  MyfileHeader* header = (MyfileHeader*)buffer;
+  if (header->version == MYFILE_VERSION_LEGACY || header->shardCount == 0)
+  {
+    shardCount = MYSQL_BLOCK_TABLE_NUM;
+    shardPolicy = MSP_XMOD;
+  }
+  else
+  {
+    shardCount = header->shardCount;
+    shardPolicy = header->shardPolicy;
+  }
+  return true;
+}
+
+int MyfilePartition::Init(const std::string &savedir, const std::string &dbfile, int i, const MyfileShardFunction* shardFunction, BlockCodec* codec, CacheMode cacheMode)
 {
   UnInit();
 
   if (!fs_system::PathExists(savedir) && !fs_system::CreateAllDirs(savedir))
     return -1;
 
-  char filename[1024] = { 0 };
+  if (!shardFunction || i >= shardFunction->getShardCount())
+    return -1;
+  int32_t shardCount = shardFunction->getShardCount();
+  int32_t shardPolicy = shardFunction->getPolicy();
+
+  std::string dbp = GetDataPath(savedir, dbfile, i);
+  std::string dbpmeta = dbp + "meta";
 #ifdef WIN32
-  sprintf_s(filename, 1024, dbfile.c_str(), i);
-  std::string dbp = savedir + DIR_DELIM + filename;
   m_datafile = new File(dbp, GENERIC_WRITE | GENERIC_READ);
-  std::string dbpmeta = savedir + DIR_DELIM + filename + "meta";
   m_metafile = new File(dbpmeta, GENERIC_WRITE | GENERIC_READ);
 #else
-  snprintf(filename, 1024, dbfile.c_str(), i);
-  std::string dbp = savedir + DIR_DELIM + filename;
-  std::string dbpmeta = savedir + DIR_DELIM + filename + "meta";
   m_datafile = new File(dbp, O_RDWR);
   m_metafile = new File(dbpmeta, O_RDWR);
 #endif
+  m_datapath = dbp;
+  m_index = i;
+  m_shardFunction = shardFunction;
+  m_codec = codec;
+  m_cacheMode = cacheMode;
 
   if (!m_datafile->IsValid())
     return -1;
@@ -144,105 +601,146 @@ int MyfilePartition::Init(const std::string &savedir, const std::string &dbfile,
   if (!m_metafile->IsValid())
     return -1;
 
-  bool isNewMetaFile = m_metafile->GetLength() == 0;
+  int64_t metaLength = m_metafile->GetLength();
+  bool isNewMetaFile = metaLength == 0;
+  int16_t version = 0;
+  if (!isNewMetaFile && m_metafile->Read(0, (char*)&version, sizeof(version)) != sizeof(version))
+    return -1;
 
-#ifdef WIN32
-  m_hFileMapping = CreateFileMapping(m_metafile->file_, NULL, PAGE_READWRITE,
-    0, VALUE_OFFSET, NULL);
-  if (m_hFileMapping == INVALID_HANDLE_VALUE)
+  if (version == MYFILE_VERSION_LEGACY || version == MYFILE_VERSION_SPARSE || version == MYFILE_VERSION_MORTON)
   {
-    LOG(ERROR) << "Unable to mmap file: " << dbfile;
-    return -1;
+    if (version == MYFILE_VERSION_LEGACY && (shardCount != MYSQL_BLOCK_TABLE_NUM || shardPolicy != MSP_XMOD))
+    {
+      LOG(ERROR) << "legacy map needs " << MYSQL_BLOCK_TABLE_NUM << " partitions: " << dbpmeta;
+      return -1;
+    }
+    delete m_metafile;
+    m_metafile = nullptr;
+    if (migrateIndex(dbpmeta, version) < 0)
+    {
+      LOG(ERROR) << "migrate index fail: " << dbpmeta;
+      return -1;
+    }
+#ifdef WIN32
+    m_metafile = new File(dbpmeta, GENERIC_WRITE | GENERIC_READ);
+#else
+    m_metafile = new File(dbpmeta, O_RDWR);
+#endif
+    if (!m_metafile->IsValid())
+      return -1;
+    metaLength = m_metafile->GetLength();
   }
-
-  m_header = (MyfileHeader*)MapViewOfFile(m_hFileMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-  if (!m_header)
+  else if (!isNewMetaFile && version != MYFILE_VERSION_INLINE)
   {
-    LOG(ERROR) << "Unable to mmap file: " << dbfile;
     return -1;
   }
-#else
+
   if (isNewMetaFile)
   {
     char* buff = (char*)malloc(VALUE_OFFSET);
     memset(buff, 0, VALUE_OFFSET);
     m_metafile->Write(0, buff, VALUE_OFFSET);
     free(buff);
+    metaLength = VALUE_OFFSET;
   }
-  m_header = (MyfileHeader*)mmap(0, VALUE_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, m_metafile->file_, 0);
-  if (m_header == (MyfileHeader*)-1)
+
+  m_header = (MyfileHeader*)MapFileRegion(m_metafile, 0, VALUE_OFFSET, true);
+  if (!m_header)
   { 
     LOG(ERROR) << "Unable to mmap file: " << dbfile;
     return -1;
   }
-#endif
 
   if (isNewMetaFile)
   {
     LOG(ERROR) << "NewMetaFile: " << dbfile;
-    memset(m_header, 0, VALUE_OFFSET);
-    m_header->version = 1;
+    m_header->version = MYFILE_VERSION_INLINE;
+    m_header->shardCount = shardCount;
+    m_header->shardPolicy = shardPolicy;
+    m_header->checksum = CT_CRC32C;
+  }
+
+  // slots keep the checksum of the file they were written to, migrated files stay CT_CRC32
+  if (!checksum::IsSupported(m_header->checksum))
+  {
+    LOG(ERROR) << "unknown checksum type: " << m_header->checksum << " file: " << dbpmeta;
+    return -1;
   }
-  else if (m_header->version != 1)
+  m_checksum = m_header->checksum;
+
+  if (m_header->shardCount == 0)
+    m_header->shardCount = MYSQL_BLOCK_TABLE_NUM;
+  if (m_header->shardCount != shardCount || m_header->shardPolicy != shardPolicy)
   {
+    LOG(ERROR) << "shard config mismatch: " << m_header->shardCount << "/" << m_header->shardPolicy
+      << " != " << shardCount << "/" << shardPolicy << " file: " << dbpmeta;
     return -1;
   }
 
-  m_buffer = new char[MAX_DATA_LENGTH];
+  if (m_header->pageCount < 0 || m_header->pageCount > MAX_INDEX_PAGE)
+    return -1;
 
-  if (cacheMode == CM_CACHE)
+  // a crash may have left the page count ahead of the zeroed pages
+  int64_t metaEnd = VALUE_OFFSET + m_header->pageCount * INDEX_PAGE_STRIDE;
+  if (metaLength < metaEnd)
   {
-    m_node = (CacheValueHandle*)malloc(MAX_NODE * sizeof(CacheValueHandle));
-    memset(m_node, CacheValueAllocator::INVALID_HANDLE, MAX_NODE * sizeof(CacheValueHandle));
+    char* buff = (char*)calloc(1, metaEnd - metaLength);
+    m_metafile->Write(metaLength, buff, metaEnd - metaLength);
+    free(buff);
   }
-  else
+
+  for (int32_t slot = 0; slot < m_header->pageCount; ++slot)
   {
-    m_node = nullptr;
+    if (!mapIndexPage(slot, m_header->page[slot]))
+    {
+      LOG(ERROR) << "Unable to map index page: " << slot << " file: " << dbfile;
+      return -1;
+    }
   }
 
-  m_cacheMode = cacheMode;
+  if (recoverCompaction(m_header->compacting != 0) < 0)
+    return -1;
+  m_header->compacting = 0;
+  m_headerDirty = std::max(m_headerDirty, HEADER_BYTES);
 
-  m_index = i;
+  rebuildFreeSlots();
+
+  m_buffer = m_bufferPool.Alloc(READ_BUFFER_BYTES);
+  m_ring = IoRing::Create(IO_RING_ENTRIES, IO_RING_BUFFER_BYTES);
   return 0;
 }
 
 int MyfilePartition::UnInit()
 {
-  delete[] m_buffer;
+  m_bufferPool.Free(m_buffer, READ_BUFFER_BYTES);
   m_buffer = NULL;
+  delete m_ring;
+  m_ring = nullptr;
+  delete m_directfile;
+  m_directfile = nullptr;
+  unmapDataFile();
 
-  for (int i = 0; m_node && i < MAX_NODE; ++i)
-  {
-    if (m_node[i] != CacheValueAllocator::INVALID_HANDLE)
-      m_cacheAllocator.free(m_node[i]);
-  }
-  m_accessCacheFIFO.clear();
-  m_prereadCacheFIFO.clear();
-
-  free(m_node);
-  m_node = NULL;
+  m_freeSlots.clear();
+  m_pendingFreeSlots.clear();
 
-#ifdef WIN32
-  if (m_header)
+  for (size_t p = 0; p < m_pages.size(); ++p)
   {
-    BOOL b = FlushViewOfFile(m_header, VALUE_OFFSET);
-    if (!b)
-      LOG(ERROR) << "FlushViewOfFile error!";
-    UnmapViewOfFile(m_header);
+    for (int i = 0; m_pages[p]->handle && i < INDEX_PAGE_NODES; ++i)
+    {
+      if (m_cacheAllocator.getValue(m_pages[p]->handle[i]))
+        removeCache(m_pages[p]->handle[i]);
+    }
   }
+  m_reclaimer.Clear();
+  m_cacheSketch.Clear();
+  m_cacheNodeCount = 0;
+  m_cacheMemoryByte = 0;
+  m_sharedExtents.clear();
+  m_sharedContent.clear();
+  m_sharedBuffers.clear();
 
-  if (m_hFileMapping != INVALID_HANDLE_VALUE)
-    CloseHandle(m_hFileMapping);
-  m_hFileMapping = INVALID_HANDLE_VALUE;
-#else
-  if (m_header)
-  {
-    msync((void *)m_header, VALUE_OFFSET, MS_SYNC);
-    munmap(m_header, VALUE_OFFSET);
-  }
-    
-#endif
-  m_header = NULL;
+  syncHeader();
+  unmapIndex();
 
   if (m_datafile)
     m_datafile->Flush(false);
@@ -255,272 +753,2044 @@ int MyfilePartition::UnInit()
   return 0;
 }
 
-bool MyfilePartition::saveBlock(int16_t x, int16_t y, int16_t z, const std::string &data, bool changed)
+IndexPage* MyfilePartition::mapIndexPage(int32_t slot, int32_t page)
 {
-  int32_t index = getLocalIndex(x, y, z);
-  int64_t globalIndex = Database::getBlockAsInteger(x, y, z);
-  if (index < 0 || index >= MAX_NODE)
+  if (page < 0 || page >= INDEX_DIR_SIZE * INDEX_DIR_SIZE)
+    return nullptr;
+
+  // published with release stores, hits without the lock walk the directory
+  IndexPage** dir = m_pageDir[page >> INDEX_DIR_BITS];
+  if (!dir)
   {
-    LOG(ERROR) << "saveBlock invalid x:" << x << " y: " << y << " z: " << z << " index:" << index;
-    return true;
+    dir = new IndexPage*[INDEX_DIR_SIZE];
+    memset(dir, 0, INDEX_DIR_SIZE * sizeof(IndexPage*));
+    __atomic_store_n(&m_pageDir[page >> INDEX_DIR_BITS], dir, __ATOMIC_RELEASE);
   }
-
-  int len = data.length() + sizeof(NodeHeader);
-  int capacity = ROUND(len, 1024);
-  if (capacity >= MAX_DATA_LENGTH)
+  if (dir[page & (INDEX_DIR_SIZE - 1)])
   {
-    LOG(ERROR) << "saveBlock data too large: " << capacity << "index: " << globalIndex;
-    return true;
+    LOG(ERROR) << "index page mapped twice: " << page;
+    return nullptr;
   }
 
-  uv_mutex_lock(&m_fileLock);
+  KeyNode* node = (KeyNode*)MapFileRegion(m_metafile, VALUE_OFFSET + slot * INDEX_PAGE_STRIDE, INDEX_PAGE_BYTES, true);
+  if (!node)
+    return nullptr;
 
-  memset(m_buffer, 0, capacity);
-  NodeHeader* header = (NodeHeader*)m_buffer;
-  header->headsize = sizeof(NodeHeader);
-  header->index = index;
-  if (!data.empty())
+  IndexPage* p = new IndexPage();
+  p->page = page;
+  p->slot = slot;
+  p->node = node;
+  p->handle = nullptr;
+  p->version = new uint32_t[INDEX_PAGE_NODES];
+  memset(p->version, 0, INDEX_PAGE_NODES * sizeof(uint32_t));
+  p->dirty = 0;
+  if (m_cacheMode == CM_CACHE)
   {
-    boost::crc_32_type crc32;
-    crc32.process_bytes(data.c_str(), data.length());
-    header->crc = crc32();
+    p->handle = new CacheValueHandle[INDEX_PAGE_NODES];
+    memset(p->handle, CacheValueAllocator::INVALID_HANDLE, INDEX_PAGE_NODES * sizeof(CacheValueHandle));
   }
-  else
+  __atomic_store_n(&dir[page & (INDEX_DIR_SIZE - 1)], p, __ATOMIC_RELEASE);
+  m_pages.push_back(p);
+  return p;
+}
+
+IndexPage* MyfilePartition::allocIndexPage(int32_t page)
+{
+  int32_t slot = m_header->pageCount;
+  if (slot >= MAX_INDEX_PAGE)
   {
-    header->crc = 0;
+    LOG(ERROR) << "index pages exhausted, partition: " << m_index;
+    return nullptr;
   }
-  time_t rawtime;
-  time(&rawtime);
-  header->timestamp = (uint64_t)rawtime;
-  header->reserved = 0xCDCDCDCD;
-  memcpy(m_buffer + sizeof(NodeHeader), data.c_str(), data.length());
 
-  KeyNode& node = m_header->node[index];
-  if (node.len == 0 && len != 0)
-    ++m_header->count;
+  // the page must exist on disk before it is mapped
+  char* buff = (char*)calloc(1, INDEX_PAGE_STRIDE);
+  bool written = m_metafile->Write(VALUE_OFFSET + slot * INDEX_PAGE_STRIDE, buff, INDEX_PAGE_STRIDE) == INDEX_PAGE_STRIDE;
+  free(buff);
+  if (!written)
+    return nullptr;
 
-  node.len = len;
-  node.flag[0] = changed ? 1 : 0;
-  node.flag[1] = 0;
-  bool ret = false;
-  if (node.capacity >= capacity && m_cacheMode != CM_APPEND)
+  IndexPage* p = mapIndexPage(slot, page);
+  if (!p)
+    return nullptr;
+
+  m_header->page[slot] = page;
+  ++m_header->pageCount;
+  m_headerDirty = std::max(m_headerDirty, HEADER_BYTES);
+  m_metadataChanged = true;
+  return p;
+}
+
+void MyfilePartition::unmapIndex()
+{
+  for (size_t p = 0; p < m_pages.size(); ++p)
   {
-    m_datafile->Seek(File::FROM_BEGIN, node.getPos());
-    ret = (m_datafile->Write(node.getPos(), m_buffer, len) == len);
+    UnmapFileRegion(m_pages[p]->node, INDEX_PAGE_BYTES);
+    delete[] m_pages[p]->handle;
+    delete[] m_pages[p]->version;
+    delete m_pages[p];
   }
-  else
+  m_pages.clear();
+  m_dirtyPages.clear();
+
+  for (int i = 0; i < INDEX_DIR_SIZE; ++i)
   {
-    node.capacity = capacity;
-    int64_t pos = m_datafile->Seek(File::FROM_END, 0);
-    if (pos % 1024 != 0)
-      LOG(ERROR) << "saveBlock data pos % 1024 != 0, index: " << globalIndex;
-    node.setPos(pos);
-    ret = (m_datafile->Write(node.getPos(), m_buffer, capacity) == capacity);
-    m_metadataChanged = true;
+    delete[] m_pageDir[i];
+    m_pageDir[i] = nullptr;
+  }
+
+  if (m_header)
+    UnmapFileRegion(m_header, VALUE_OFFSET);
+  m_header = NULL;
+}
+
+IndexPage* MyfilePartition::findPage(int64_t index)
+{
+  if (index < 0)
+    return nullptr;
+
+  int64_t page = index >> INDEX_PAGE_BITS;
+  IndexPage** dir = __atomic_load_n(&m_pageDir[(page >> INDEX_DIR_BITS) & (INDEX_DIR_SIZE - 1)], __ATOMIC_ACQUIRE);
+  return dir ? __atomic_load_n(&dir[page & (INDEX_DIR_SIZE - 1)], __ATOMIC_ACQUIRE) : nullptr;
+}
+
+KeyNode* MyfilePartition::findNode(int64_t index)
+{
+  IndexPage* p = findPage(index);
+  return p ? &p->node[index & (INDEX_PAGE_NODES - 1)] : nullptr;
+}
+
+KeyNode* MyfilePartition::getNode(int64_t index)
+{
+  KeyNode* node = findNode(index);
+  if (node || index < 0)
+    return node;
+
+  IndexPage* p = allocIndexPage((int32_t)(index >> INDEX_PAGE_BITS));
+  return p ? &p->node[index & (INDEX_PAGE_NODES - 1)] : nullptr;
+}
+
+void MyfilePartition::markDirty(int64_t index)
+{
+  IndexPage* p = findPage(index);
+  if (!p)
+    return;
+
+  int64_t offset = (index & (INDEX_PAGE_NODES - 1)) * sizeof(KeyNode);
+  uint64_t bits = 0;
+  for (int64_t b = offset / INDEX_SYNC_BYTES; b <= (offset + (int64_t)sizeof(KeyNode) - 1) / INDEX_SYNC_BYTES; ++b)
+    bits |= 1ULL << b;
+  if (p->dirty == 0)
+    m_dirtyPages.push_back(p);
+  p->dirty |= bits;
+}
+
+void MyfilePartition::markAllDirty()
+{
+  m_dirtyPages.clear();
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    m_pages[p]->dirty = ~0ULL;
+    m_dirtyPages.push_back(m_pages[p]);
+  }
+  m_headerDirty = std::max(m_headerDirty, HEADER_BYTES);
+}
+
+CacheValueHandle* MyfilePartition::findHandle(int64_t index)
+{
+  IndexPage* p = findPage(index);
+  return p && p->handle ? &p->handle[index & (INDEX_PAGE_NODES - 1)] : nullptr;
+}
+
+bool MyfilePartition::migrateNode(int64_t index, const KeyNodeV3& old, bool patchSlot)
+{
+  KeyNode* node = index >= 0 ? getNode(index) : nullptr;
+  if (!node)
+    return false;
+  node->setPos(old.getPos());
+  node->capacity = old.capacity;
+  node->len = old.len;
+  node->flag[0] = old.flag[0];
+  node->flag[1] = old.flag[1];
+  markDirty(index);
+  if (old.len == 0 || !patchSlot)  // a delete that is still in the modify list
+    return true;
+
+  uint32_t saveIndex = (uint32_t)index;
+  return m_datafile->Write(old.getPos() + offsetof(NodeHeader, index), (const char*)&saveIndex, sizeof(saveIndex)) == sizeof(saveIndex);
+}
+
+int MyfilePartition::migrateIndex(const std::string& metapath, int16_t version)
+{
+  LOG(ERROR) << "migrate index version " << version << ": " << metapath;
+
+  int64_t headerBytes = version == MYFILE_VERSION_LEGACY ? LEGACY_VALUE_OFFSET : VALUE_OFFSET;
+#ifdef WIN32
+  File* oldfile = new File(metapath, GENERIC_READ);
+#else
+  File* oldfile = new File(metapath, O_RDONLY);
+#endif
+  char* oldheader = nullptr;
+  if (oldfile->IsValid() && oldfile->GetLength() >= headerBytes)
+    oldheader = (char*)MapFileRegion(oldfile, 0, headerBytes, false);
+
+  MyfileHeaderV1* legacy = (MyfileHeaderV1*)oldheader;
+  MyfileHeader* sparse = (MyfileHeader*)oldheader;
+  bool compacting = oldheader && (version == MYFILE_VERSION_LEGACY ? legacy->compacting != 0 : sparse->compacting != 0);
+  if (!oldheader || recoverCompaction(compacting) < 0)
+  {
+    if (oldheader)
+      UnmapFileRegion(oldheader, headerBytes);
+    delete oldfile;
+    return -1;
+  }
+
+  // the new index is built aside, the rename below is the commit point. the data file
+  // node headers are patched to the new keys, redoing that after a crash gives the same result.
+  std::string tmppath = metapath + ".migrate";
+  fs_system::DeleteSingleFile(tmppath);
+#ifdef WIN32
+  m_metafile = new File(tmppath, GENERIC_WRITE | GENERIC_READ);
+#else
+  m_metafile = new File(tmppath, O_RDWR);
+#endif
+  char* buff = (char*)calloc(1, VALUE_OFFSET);
+  bool ok = m_metafile->IsValid() && m_metafile->Write(0, buff, VALUE_OFFSET) == VALUE_OFFSET;
+  free(buff);
+  if (ok)
+    m_header = (MyfileHeader*)MapFileRegion(m_metafile, 0, VALUE_OFFSET, true);
+  ok = ok && m_header;
+
+  if (version == MYFILE_VERSION_LEGACY)
+  {
+    for (int32_t i = 0; ok && i < LEGACY_MAX_NODE; ++i)
+    {
+      const KeyNodeV3& old = legacy->node[i];
+      if (old.len == 0 && old.flag[0] == 0)
+        continue;
+
+      int16_t z = i & 1023;
+      int16_t x = ((i >> 10) & 63) * MYSQL_BLOCK_TABLE_NUM + m_index;
+      int16_t y = (i >> 16) - 14;
+      ok = migrateNode(getLocalIndex(x, y, z), old, true);
+    }
+  }
+  else
+  {
+    int32_t pageCount = sparse->pageCount;
+    if (pageCount < 0 || pageCount > MAX_INDEX_PAGE || oldfile->GetLength() < VALUE_OFFSET + pageCount * INDEX_PAGE_STRIDE_V3)
+      ok = false;
+
+    for (int32_t slot = 0; ok && slot < pageCount; ++slot)
+    {
+      int64_t page = sparse->page[slot];
+      KeyNodeV3* oldnode = (KeyNodeV3*)MapFileRegion(oldfile, VALUE_OFFSET + slot * INDEX_PAGE_STRIDE_V3, INDEX_PAGE_BYTES_V3, false);
+      if (!oldnode)
+      {
+        ok = false;
+        break;
+      }
+
+      for (int32_t n = 0; ok && n < INDEX_PAGE_NODES; ++n)
+      {
+        if (oldnode[n].len == 0 && oldnode[n].flag[0] == 0)
+          continue;
+
+        // version 3 keys are the current ones, only the KeyNode widens
+        if (version == MYFILE_VERSION_MORTON)
+        {
+          ok = migrateNode((page << INDEX_PAGE_BITS) | n, oldnode[n], false);
+          continue;
+        }
+
+        // version 2 keys are brick linear, z fastest
+        int32_t uz = ((page & 255) << 4) | (n & 15);
+        int32_t ux = (((page >> 8) & 255) << 4) | ((n >> 4) & 15);
+        int32_t uy = (int32_t)((page >> 16) << 4) | (n >> 8);
+        int32_t x, y, z;
+        m_shardFunction->toGlobal(m_index, ux, uy, uz, x, y, z);
+        ok = migrateNode(getLocalIndex(x, y, z), oldnode[n], true);
+      }
+      UnmapFileRegion(oldnode, INDEX_PAGE_BYTES_V3);
+    }
+  }
+
+  if (ok)
+  {
+    if (version == MYFILE_VERSION_LEGACY)
+    {
+      m_header->sequence = legacy->sequence;
+      m_header->count = legacy->count;
+      m_header->shardCount = MYSQL_BLOCK_TABLE_NUM;
+      m_header->shardPolicy = MSP_XMOD;
+    }
+    else
+    {
+      m_header->sequence = sparse->sequence;
+      m_header->count = sparse->count;
+      m_header->shardCount = sparse->shardCount;
+      m_header->shardPolicy = sparse->shardPolicy;
+    }
+    m_datafile->Flush(true);
+    m_headerDirty = std::max(m_headerDirty, HEADER_FIELD_BYTES);
+    syncHeader();
+    m_header->version = MYFILE_VERSION_INLINE;
+    m_headerDirty = std::max(m_headerDirty, HEADER_FIELD_BYTES);
+    syncHeader();
+  }
+
+  unmapIndex();
+  delete m_metafile;
+  m_metafile = nullptr;
+  UnmapFileRegion(oldheader, headerBytes);
+  delete oldfile;
+
+  if (!ok)
+  {
+    fs_system::DeleteSingleFile(tmppath);
+    return -1;
+  }
+  return fs_system::Rename(tmppath, metapath) ? 0 : -1;
+}
+
+bool MyfilePartition::prepareSlot(int16_t x, int16_t y, int16_t z, const char* data, int dataLen, BlockBuffer* block, bool changed, SlotWrite& write)
+{
+  write.index = getLocalIndex(x, y, z);
+  write.globalIndex = Database::getBlockAsInteger(x, y, z);
+  if (write.index < 0)
+  {
+    LOG(ERROR) << "saveBlock invalid x:" << x << " y: " << y << " z: " << z << " index:" << write.index;
+    return false;
+  }
+
+  // compression and checksum run before the partition lock is taken
+  write.data = data;
+  write.dataLen = dataLen;
+  write.block = block;
+  write.codec = MC_RAW;
+  write.dict = 0;
+  int valueLen = dataLen;
+  if (m_codec && m_codec->Compress(data, dataLen, write.compressed, write.codec, write.dict))
+    valueLen = write.compressed.length();
+  else
+    write.codec = MC_RAW;
+  const char* value = write.value();
+
+  // tiny values are stored in the KeyNode, len still counts the NodeHeader they do not have
+  write.inlined = valueLen <= INLINE_VALUE_LENGTH;
+  write.len = valueLen + sizeof(NodeHeader);
+  write.capacity = write.inlined ? 0 : ROUND(write.len, 1024);
+  if (write.capacity >= MAX_DATA_LENGTH)
+  {
+    LOG(ERROR) << "saveBlock data too large: " << write.capacity << "index: " << write.globalIndex;
+    return false;
+  }
+
+  write.valueLen = valueLen;
+  write.changed = changed;
+  write.crc = checksum::Compute(m_checksum, value, valueLen);
+  write.dedup = m_dedup && !write.inlined;
+  write.writePos = -1;
+  write.writeLen = 0;
+  if (write.inlined)
+    return true;
+
+  // the value is written from where it is, behind the header
+  NodeHeader& header = write.header;
+  header.headsize = sizeof(NodeHeader);
+  header.index = write.dedup ? SHARED_NODE_INDEX : (uint32_t)write.index;
+  header.crc = write.crc;
+  time_t rawtime;
+  time(&rawtime);
+  header.timestamp = (uint64_t)rawtime;
+  header.codec = write.codec;
+  header.dict = write.dict;
+  header.reserved = 0xCDCD;
+  return true;
+}
+
+// slots are padded with zeros up to their 1K capacity
+static const char s_slotPadding[1024] = { 0 };
+
+void MyfilePartition::appendSlotBuffers(const SlotWrite& write, std::vector<FileBuffer>& buffers)
+{
+  FileBuffer header = { (const char*)&write.header, (int)sizeof(NodeHeader) };
+  FileBuffer value = { write.value(), write.valueLen };
+  FileBuffer padding = { s_slotPadding, write.writeLen - write.len };
+  buffers.push_back(header);
+  buffers.push_back(value);
+  if (padding.size > 0)
+    buffers.push_back(padding);
+}
+
+bool MyfilePartition::placeSlot(SlotWrite& write)
+{
+  int64_t index = write.index;
+  int len = write.len;
+  int capacity = write.capacity;
+  KeyNode* pnode = getNode(index);
+  if (!pnode)
+  {
+    LOG(ERROR) << "saveBlock no index page, index: " << write.globalIndex;
+    return false;
+  }
+
+  KeyNode& node = *pnode;
+  IndexPage* page = findPage(index);
+  page->seq.WriteBegin();
+  ++page->version[index & (INDEX_PAGE_NODES - 1)];
+  markDirty(index);
+  if (node.len == 0 && len != 0)
+  {
+    ++m_header->count;
+    m_headerDirty = std::max(m_headerDirty, HEADER_FIELD_BYTES);
+  }
+
+  // a shared slot counts once, releaseSlot drops it with its last node
+  if (node.len != 0 && node.flag[1] == KNK_SLOT)
+    m_liveBytes -= ROUND(node.len, 1024);
+  if (m_compacting)
+    m_compactDirty.push_back(index);
+
+  node.len = len;
+  node.flag[0] = write.changed ? 1 : 0;
+  int64_t shared = write.dedup ? findSharedExtent(write) : -1;
+  if (write.inlined)
+  {
+    releaseSlot(node);
+    node.flag[1] = KNK_INLINE;
+    node.codec = write.codec;
+    node.dict = write.dict;
+    node.crc = write.crc;
+    memcpy(node.value, write.value(), write.valueLen);
+    m_metadataChanged = true;
+  }
+  else if (shared >= 0)
+  {
+    // the value is stored already, only the node moves
+    if (node.flag[1] != KNK_SHARED || node.getPos() != shared)
+    {
+      SharedExtent& extent = m_sharedExtents[shared];
+      ++extent.refcount;
+      releaseSlot(node);
+      node.capacity = extent.capacity;
+      node.setPos(shared);
+      node.flag[1] = KNK_SHARED;
+      m_metadataChanged = true;
+    }
+    ++m_dedupHits;
+  }
+  else if (!write.dedup && node.flag[1] == KNK_SLOT && node.capacity >= capacity && m_cacheMode != CM_APPEND)
+  {
+    m_liveBytes += capacity;
+    write.writePos = node.getPos();
+    write.writeLen = capacity;
+  }
+  else
+  {
+    int64_t pos = -1;
+    if (m_cacheMode != CM_APPEND)
+    {
+      // place the slot right behind the previous index if a hole allows it
+      int64_t hint = node.capacity > 0 ? node.getPos() : 0;
+      KeyNode* prev = findNode(index - 1);
+      if (prev && prev->capacity > 0)
+        hint = prev->getPos() + prev->capacity;
+      pos = m_freeSlots.alloc(capacity, hint);
+    }
+    if (pos < 0)
+    {
+      // appended behind the slots placed earlier in the same batch, they are not written yet
+      pos = std::max(m_datafile->Seek(File::FROM_END, 0), m_appendPos);
+      m_appendPos = pos + capacity;
+    }
+    if (pos % 1024 != 0)
+      LOG(ERROR) << "saveBlock data pos % 1024 != 0, index: " << write.globalIndex;
+    releaseSlot(node);
+    node.capacity = capacity;
+    node.setPos(pos);
+    write.writePos = pos;
+    write.writeLen = capacity;
+    m_liveBytes += capacity;
+    if (write.dedup)
+    {
+      // registered even when the write fails, the slot is taken and its crc keeps it from matching
+      SharedExtent extent;
+      extent.capacity = capacity;
+      extent.len = len;
+      extent.crc = write.crc;
+      extent.refcount = 1;
+      addSharedExtent(pos, extent);
+      node.flag[1] = KNK_SHARED;
+    }
+    m_metadataChanged = true;
+  }
+  page->seq.WriteEnd();
+  return true;
+}
+
+void MyfilePartition::finishSlot(SlotWrite& write, bool written)
+{
+  if (written && !write.inlined)
+    cacheBlock(write.index, write.data, write.dataLen, true, false, nullptr, write.block);
+  else if (!written)
+    LOG(ERROR) << "saveBlock write fail! index: " << write.globalIndex;
+}
+
+bool MyfilePartition::saveBlock(int16_t x, int16_t y, int16_t z, const std::string &data, bool changed, bool* stored)
+{
+  SlotWrite write;
+  bool prepared = prepareSlot(x, y, z, data.c_str(), data.length(), nullptr, changed, write);
+  if (stored)
+    *stored = prepared;
+  if (!prepared)
+    return true;
+  return writeSlot(write);
+}
+
+bool MyfilePartition::saveBlockRef(int16_t x, int16_t y, int16_t z, const BlockRef &data, bool changed)
+{
+  SlotWrite write;
+  if (!prepareSlot(x, y, z, data.data(), data.size(), data.get(), changed, write))
+    return true;
+  return writeSlot(write);
+}
+
+bool MyfilePartition::writeSlot(SlotWrite& write)
+{
+  ++m_writeCount;
+  lockFile();
+  bool placed = placeSlot(write);
+  m_appendPos = 0;
+  if (!placed)
+  {
+    uv_mutex_unlock(&m_fileLock);
+    return false;
+  }
+
+  bool ret = true;
+  if (write.writePos >= 0)
+  {
+    std::vector<FileBuffer> buffers;
+    appendSlotBuffers(write, buffers);
+    ret = (m_datafile->WriteV(write.writePos, &buffers[0], (int)buffers.size()) == write.writeLen);
+    if (ret && !m_logged)
+      m_datafile->TryFlush(write.writePos, write.writeLen);
+  }
+  finishSlot(write, ret);
+
+  uv_mutex_unlock(&m_fileLock);
+
+  return ret;
+}
+
+bool MyfilePartition::saveBlocks(const std::vector<const std::pair<int64_t, std::string>*>& blocks, bool changed)
+{
+  std::vector<SlotWrite> writes(blocks.size());
+  size_t count = 0;
+  for (size_t i = 0; i < blocks.size(); ++i)
+  {
+    int16_t x, y, z;
+    Database::getIntegerAsBlock(blocks[i]->first, x, y, z);
+    const std::string& data = blocks[i]->second;
+    if (prepareSlot(x, y, z, data.c_str(), data.length(), nullptr, changed, writes[count]))
+      ++count;
+  }
+  writes.resize(count);
+
+  // the slots of the whole batch are placed under one lock and then written in file order
+  m_writeCount += count;
+  lockFile();
+  bool ret = true;
+  std::vector<SlotWrite*> pending;
+  std::vector<char> placed(count, 0);
+  for (size_t i = 0; i < count; ++i)
+  {
+    placed[i] = placeSlot(writes[i]);
+    ret &= (placed[i] != 0);
+    writes[i].written = true;
+    if (placed[i] && writes[i].writePos >= 0)
+      pending.push_back(&writes[i]);
+  }
+  m_appendPos = 0;
+  // a node rewritten in place twice keeps its order, the later write lands last
+  std::stable_sort(pending.begin(), pending.end(),
+    [](const SlotWrite* a, const SlotWrite* b) { return a->writePos < b->writePos; });
+
+  std::vector<FileBuffer> buffers;
+  for (size_t i = 0; i < pending.size();)
+  {
+    // slots adjacent in the file go out with one pwritev
+    size_t end = i + 1;
+    int64_t next = pending[i]->writePos + pending[i]->writeLen;
+    while (end < pending.size() && pending[end]->writePos == next && next - pending[i]->writePos < MAX_WRITE_RUN_BYTES)
+      next += pending[end++]->writeLen;
+
+    buffers.clear();
+    for (size_t k = i; k < end; ++k)
+      appendSlotBuffers(*pending[k], buffers);
+    int bytes = (int)(next - pending[i]->writePos);
+    bool ok = m_datafile->WriteV(pending[i]->writePos, &buffers[0], (int)buffers.size()) == bytes;
+    if (ok && !m_logged)
+      m_datafile->TryFlush(pending[i]->writePos, bytes);
+    for (size_t k = i; k < end; ++k)
+      pending[k]->written = ok;
+    ++m_writeRuns;
+    i = end;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (!placed[i])
+      continue;
+    finishSlot(writes[i], writes[i].written);
+    ret &= writes[i].written;
+  }
+  uv_mutex_unlock(&m_fileLock);
+
+  return ret;
+}
+
+int64_t MyfilePartition::getLocalIndex(int16_t x, int16_t y, int16_t z)
+{
+  int32_t ux, uy, uz;
+  if (!m_shardFunction->toLocal(x, y, z, ux, uy, uz))
+  {
+    //LOG(ERROR) << "invalid x:" << x << " y: " << y << " z: " << z;
+    return -1;
+  }
+
+  // z in the lowest bit, the low 12 bits are the slot of a 16x16x16 brick
+  return (int64_t)(SpreadBits12(uz) | (SpreadBits12(ux) << 1) | (SpreadBits12(uy) << 2));
+}
+
+int64_t MyfilePartition::getGlobalIndex(int64_t localindex)
+{
+  int32_t uz = CompactBits12(localindex);
+  int32_t ux = CompactBits12(localindex >> 1);
+  int32_t uy = CompactBits12(localindex >> 2);
+  int32_t x, y, z;
+  m_shardFunction->toGlobal(m_index, ux, uy, uz, x, y, z);
+  return Database::getBlockAsInteger(x, y, z);
+}
+
+void MyfilePartition::flush()
+{
+  std::vector<std::pair<int64_t, int32_t>> released;
+  std::vector<std::pair<char*, int64_t>> ranges;
+  uv_mutex_lock(&m_fileLock);
+  bool onlyData = !m_metadataChanged;
+  m_metadataChanged = false;
+  released.swap(m_pendingFreeSlots);
+  collectDirty(ranges);
+  int32_t generation = m_dataGeneration;
+  bool direct = m_directfile != nullptr;
+  uv_mutex_unlock(&m_fileLock);
+  if (m_datafile)
+    m_datafile->Flush(onlyData);
+  // the loads bypass the page cache, the written pages would only double what the partition caches
+  if (m_datafile && direct)
+    m_datafile->DropCache();
+
+  // only the index ranges written since the last flush
+  for (size_t i = 0; i < ranges.size(); ++i)
+    SyncFileRegion(ranges[i].first, ranges[i].second);
+
+  // the synced header no longer references these slots, unless a compaction replaced the file meanwhile
+  uv_mutex_lock(&m_fileLock);
+  for (size_t i = 0; generation == m_dataGeneration && i < released.size(); ++i)
+    m_freeSlots.release(released[i].first, released[i].second);
+  uv_mutex_unlock(&m_fileLock);
+}
+
+void MyfilePartition::releaseSlot(KeyNode& node)
+{
+  bool release = node.capacity != 0;
+  if (node.flag[1] == KNK_SHARED)
+  {
+    auto it = m_sharedExtents.find(node.getPos());
+    release = it != m_sharedExtents.end() && --it->second.refcount == 0;
+    if (release)
+    {
+      m_liveBytes -= it->second.capacity;
+      auto range = m_sharedContent.equal_range(SharedContentKey(it->second.crc, it->second.len));
+      for (auto c = range.first; c != range.second; ++c)
+      {
+        if (c->second == it->first)
+        {
+          m_sharedContent.erase(c);
+          break;
+        }
+      }
+      m_sharedExtents.erase(it);
+    }
+  }
+  if (release && m_cacheMode != CM_APPEND)
+    m_pendingFreeSlots.push_back(std::make_pair(node.getPos(), (int32_t)node.capacity));
+  node.capacity = 0;
+  node.setPos(0);
+  node.flag[1] = KNK_SLOT;
+}
+
+int64_t MyfilePartition::findSharedExtent(const SlotWrite& write)
+{
+  int len = write.len;
+  auto range = m_sharedContent.equal_range(SharedContentKey(write.crc, len));
+  for (auto it = range.first; it != range.second; ++it)
+  {
+    // a cached copy saves the read, otherwise the candidate is compared on disk
+    SharedExtent& extent = m_sharedExtents[it->second];
+    auto buffer = m_sharedBuffers.find(extent.id);
+    if (buffer != m_sharedBuffers.end())
+    {
+      if (buffer->second->len == write.dataLen && memcmp(buffer->second->data, write.data, write.dataLen) == 0)
+        return it->second;
+      continue;
+    }
+
+    if (m_datafile->Read(it->second, m_buffer, len) != len)
+      continue;
+    const NodeHeader* stored = (const NodeHeader*)m_buffer;
+    if (stored->index == SHARED_NODE_INDEX && stored->codec == write.codec && stored->dict == write.dict
+      && memcmp(m_buffer + sizeof(NodeHeader), write.value(), write.valueLen) == 0)
+      return it->second;
+  }
+  return -1;
+}
+
+void MyfilePartition::addSharedExtent(int64_t pos, const SharedExtent& extent)
+{
+  SharedExtent& added = m_sharedExtents[pos];
+  added = extent;
+  added.id = m_nextExtentId++;
+  m_sharedContent.insert(std::make_pair(SharedContentKey(extent.crc, extent.len), pos));
+}
+
+void MyfilePartition::GetDedupSummary(int64_t& extents, int64_t& refs, int64_t& hits)
+{
+  uv_mutex_lock(&m_fileLock);
+  extents = m_sharedExtents.size();
+  refs = 0;
+  for (auto it = m_sharedExtents.begin(); it != m_sharedExtents.end(); ++it)
+    refs += it->second.refcount;
+  hits = m_dedupHits;
+  uv_mutex_unlock(&m_fileLock);
+}
+
+void MyfilePartition::rebuildFreeSlots()
+{
+  std::vector<std::pair<int64_t, int32_t>> used;
+  std::map<int64_t, SharedExtent> shared;
+  m_liveBytes = 0;
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      KeyNode& node = m_pages[p]->node[n];
+      if (node.len == 0)
+      {
+        // deleted before the allocator existed, the slot is a hole now
+        if (node.capacity != 0 || node.getPos() != 0 || node.flag[1] != KNK_SLOT)
+          markDirty(((int64_t)m_pages[p]->page << INDEX_PAGE_BITS) | n);
+        node.capacity = 0;
+        node.setPos(0);
+        node.flag[1] = KNK_SLOT;
+        continue;
+      }
+      if (node.flag[1] == KNK_INLINE)
+        continue;
+      if (node.flag[1] == KNK_SHARED)
+      {
+        SharedExtent& extent = shared[node.getPos()];
+        extent.capacity = node.capacity;
+        extent.len = node.len;
+        ++extent.refcount;
+        continue;
+      }
+      m_liveBytes += ROUND(node.len, 1024);
+      used.push_back(std::make_pair(node.getPos(), (int32_t)node.capacity));
+    }
+  }
+
+  // the refcounts of the shared slots come from the index, their crc from the slot header
+  m_sharedExtents.clear();
+  m_sharedContent.clear();
+  for (auto it = shared.begin(); it != shared.end(); ++it)
+  {
+    NodeHeader header;
+    if (m_datafile->Read(it->first, (char*)&header, sizeof(header)) == sizeof(header))
+      it->second.crc = header.crc;
+    addSharedExtent(it->first, it->second);
+    m_liveBytes += it->second.capacity;
+    used.push_back(std::make_pair(it->first, (int32_t)it->second.capacity));
+  }
+  std::sort(used.begin(), used.end());
+
+  m_freeSlots.clear();
+  m_pendingFreeSlots.clear();
+  if (m_cacheMode == CM_APPEND)
+    return;
+
+  int64_t end = 0;
+  for (size_t i = 0; i < used.size(); ++i)
+  {
+    if (used[i].first > end)
+      m_freeSlots.release(end, used[i].first - end);
+    end = std::max(end, used[i].first + used[i].second);
+  }
+  int64_t length = m_datafile->GetLength() / 1024 * 1024;
+  if (length > end)
+    m_freeSlots.release(end, length - end);
+}
+
+void MyfilePartition::syncHeader()
+{
+  std::vector<std::pair<char*, int64_t>> ranges;
+  collectDirty(ranges);
+  for (size_t i = 0; i < ranges.size(); ++i)
+    SyncFileRegion(ranges[i].first, ranges[i].second);
+}
+
+void MyfilePartition::collectDirty(std::vector<std::pair<char*, int64_t>>& ranges)
+{
+  for (size_t p = 0; p < m_dirtyPages.size(); ++p)
+  {
+    IndexPage* page = m_dirtyPages[p];
+    for (int b = 0; b < 64;)
+    {
+      if (!(page->dirty & (1ULL << b)))
+      {
+        ++b;
+        continue;
+      }
+      int e = b;
+      while (e < 64 && (page->dirty & (1ULL << e)))
+        ++e;
+      ranges.push_back(std::make_pair((char*)page->node + b * INDEX_SYNC_BYTES, (e - b) * INDEX_SYNC_BYTES));
+      b = e;
+    }
+    page->dirty = 0;
+  }
+  m_dirtyPages.clear();
+
+  if (m_header && m_headerDirty > 0)
+    ranges.push_back(std::make_pair((char*)m_header, m_headerDirty));
+  m_headerDirty = 0;
+}
+
+int MyfilePartition::recoverCompaction(bool compacting)
+{
+  std::string compactpath = m_datapath + ".compact";
+  if (!compacting)
+  {
+    // a compaction died before its header update, the old data file is still the valid one
+    fs_system::DeleteSingleFile(compactpath);
+    return 0;
+  }
+
+  // the header already points into the compacted file, finish the rename
+  if (fs_system::PathExists(compactpath))
+  {
+    LOG(ERROR) << "finish interrupted compaction: " << m_datapath;
+    delete m_datafile;
+    m_datafile = nullptr;
+    if (!fs_system::Rename(compactpath, m_datapath) || !fs_system::SyncParentDir(m_datapath))
+      return -1;
+#ifdef WIN32
+    m_datafile = new File(m_datapath, GENERIC_WRITE | GENERIC_READ);
+#else
+    m_datafile = new File(m_datapath, O_RDWR);
+#endif
+    if (!m_datafile->IsValid())
+      return -1;
+  }
+
+  return 0;
+}
+
+void MyfilePartition::GetSpaceSummary(int64_t& liveBytes, int64_t& fileBytes, int64_t& freeBytes)
+{
+  uv_mutex_lock(&m_fileLock);
+  liveBytes = m_liveBytes;
+  fileBytes = m_datafile ? m_datafile->GetLength() : 0;
+  freeBytes = m_freeSlots.freeBytes();
+  uv_mutex_unlock(&m_fileLock);
+}
+
+int MyfilePartition::copySlot(File* dst, int64_t dstPos, int64_t srcPos, int len, char* buffer)
+{
+  int capacity = ROUND(len, 1024);
+  if (m_datafile->Read(srcPos, buffer, len) != len)
+    return -1;
+  memset(buffer + len, 0, capacity - len);
+  if (dst->Write(dstPos, buffer, capacity) != capacity)
+    return -1;
+  return capacity;
+}
+
+int MyfilePartition::Compact(const std::atomic<bool>* stop)
+{
+  struct CompactSlot
+  {
+    int64_t pos;
+    uint16_t capacity;
+  };
+
+  std::string compactpath = m_datapath + ".compact";
+  fs_system::DeleteSingleFile(compactpath);
+#ifdef WIN32
+  File* compactfile = new File(compactpath, GENERIC_WRITE | GENERIC_READ);
+#else
+  File* compactfile = new File(compactpath, O_RDWR);
+#endif
+  if (!compactfile->IsValid())
+  {
+    delete compactfile;
+    return -1;
+  }
+
+  std::vector<int64_t> live;
+  uv_mutex_lock(&m_fileLock);
+  if (m_compacting || !m_header)
+  {
+    uv_mutex_unlock(&m_fileLock);
+    delete compactfile;
+    return -1;
+  }
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    int64_t base = (int64_t)m_pages[p]->page << INDEX_PAGE_BITS;
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      if (m_pages[p]->node[n].len != 0)
+        live.push_back(base | n);
+    }
+  }
+  std::sort(live.begin(), live.end());
+  m_compacting = true;
+  m_compactDirty.clear();
+  m_compactCopied = 0;
+  m_compactTotal = live.size();
+  uv_mutex_unlock(&m_fileLock);
+
+  // live slots are copied in index order, so the index + 1 readahead chaining in
+  // ProcessReadBuffer hits again after the compaction.
+  std::map<int64_t, CompactSlot> moved;
+  std::map<int64_t, CompactSlot> movedExtents;  // by extent id, a shared slot is copied once
+  char* buffer = new char[MAX_DATA_LENGTH];
+  int64_t writePos = 0;
+  bool ok = true;
+
+  auto copyNode = [&](int64_t index, bool locked) -> bool
+  {
+    if (!locked)
+      uv_mutex_lock(&m_fileLock);
+    KeyNode node = *findNode(index);
+    int64_t extentId = -1;
+    if (node.flag[1] == KNK_SHARED)
+    {
+      auto extent = m_sharedExtents.find(node.getPos());
+      if (extent != m_sharedExtents.end())
+        extentId = extent->second.id;
+    }
+    if (!locked)
+      uv_mutex_unlock(&m_fileLock);
+
+    // inline nodes have no slot to copy
+    if (node.len == 0 || node.flag[1] == KNK_INLINE)
+    {
+      moved.erase(index);
+      return true;
+    }
+
+    auto copied = movedExtents.find(extentId);
+    if (extentId >= 0 && copied != movedExtents.end())
+    {
+      moved[index] = copied->second;
+      return true;
+    }
+
+    // the slot may be rewritten meanwhile, such nodes are in m_compactDirty and copied again
+    int capacity = copySlot(compactfile, writePos, node.getPos(), node.len, buffer);
+    if (capacity < 0)
+    {
+      LOG(ERROR) << "compact copy fail! index: " << getGlobalIndex(index);
+      return false;
+    }
+    CompactSlot& slot = moved[index];
+    slot.pos = writePos;
+    slot.capacity = capacity;
+    if (extentId >= 0)
+      movedExtents[extentId] = slot;
+    writePos += capacity;
+    return true;
+  };
+
+  for (size_t i = 0; ok && i < live.size(); ++i)
+  {
+    if (stop && *stop)
+      ok = false;
+    else
+      ok = copyNode(live[i], false);
+    ++m_compactCopied;
+  }
+
+  // catch up with the writes done during the copy before blocking the partition
+  for (int pass = 0; ok && pass < 3; ++pass)
+  {
+    uv_mutex_lock(&m_fileLock);
+    std::vector<int64_t> dirty;
+    dirty.swap(m_compactDirty);
+    uv_mutex_unlock(&m_fileLock);
+    if (dirty.empty())
+      break;
+
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    for (size_t i = 0; ok && i < dirty.size(); ++i)
+      ok = copyNode(dirty[i], false);
+  }
+
+  uv_mutex_lock(&m_fileLock);
+  for (size_t i = 0; ok && i < m_compactDirty.size(); ++i)
+    ok = copyNode(m_compactDirty[i], true);
+  m_compactDirty.clear();
+  m_compacting = false;
+
+  // the compacted file and its directory entry are on disk before the header points into it
+  ok = ok && compactfile->Flush(false) && fs_system::SyncParentDir(compactpath);
+  if (!ok)
+  {
+    uv_mutex_unlock(&m_fileLock);
+    delete[] buffer;
+    delete compactfile;
+    fs_system::DeleteSingleFile(compactpath);
+    return -1;
+  }
+
+  m_datafile->Flush(false);
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    int64_t base = (int64_t)m_pages[p]->page << INDEX_PAGE_BITS;
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      KeyNode& node = m_pages[p]->node[n];
+      auto it = moved.find(base | n);
+      if (it == moved.end())
+      {
+        // deleted nodes keep no slot, the old position is meaningless in the new file
+        node.capacity = 0;
+        node.setPos(0);
+        continue;
+      }
+      node.capacity = it->second.capacity;
+      node.setPos(it->second.pos);
+    }
+  }
+  std::map<int64_t, SharedExtent> shared;
+  shared.swap(m_sharedExtents);
+  m_sharedContent.clear();
+  for (auto it = shared.begin(); it != shared.end(); ++it)
+  {
+    auto copied = movedExtents.find(it->second.id);
+    if (copied == movedExtents.end())
+      continue;
+    SharedExtent& extent = m_sharedExtents[copied->second.pos];
+    extent = it->second;
+    extent.capacity = copied->second.capacity;
+    m_sharedContent.insert(std::make_pair(SharedContentKey(extent.crc, extent.len), copied->second.pos));
+  }
+  // the compacted file has no holes
+  m_freeSlots.clear();
+  m_pendingFreeSlots.clear();
+  ++m_dataGeneration;
+  m_header->compacting = 1;
+  markAllDirty();
+  syncHeader();
+
+  delete compactfile;
+  uv_rwlock_wrlock(&m_swapLock);
+  delete m_datafile;
+  m_datafile = nullptr;
+  // compacting is cleared only once the rename is on disk, otherwise a power loss could keep the
+  // header update and lose the rename, and Init would delete the compacted file
+  if (fs_system::Rename(compactpath, m_datapath))
+  {
+#ifdef WIN32
+    m_datafile = new File(m_datapath, GENERIC_WRITE | GENERIC_READ);
+#else
+    m_datafile = new File(m_datapath, O_RDWR);
+#endif
+  }
+
+  int ret = 0;
+  unmapDataFile();
+  if (m_datafile && m_datafile->IsValid())
+    openDirectFile();
+  if (m_datafile && m_datafile->IsValid() && fs_system::SyncParentDir(m_datapath))
+  {
+    m_header->compacting = 0;
+    m_headerDirty = std::max(m_headerDirty, HEADER_FIELD_BYTES);
+    syncHeader();
+  }
+  else
+  {
+    // keep compacting = 1, the next Init finishes the swap
+    LOG(ERROR) << "compact swap fail: " << m_datapath;
+    ret = -1;
+  }
+  uv_rwlock_wrunlock(&m_swapLock);
+  m_metadataChanged = true;
+  uv_mutex_unlock(&m_fileLock);
+
+  delete[] buffer;
+  return ret;
+}
+
+#define SCRUB_CHUNK_BYTES (1024 * 1024)
+
+bool MyfilePartition::checkSlot(const char* slot, int len, int64_t index, bool shared, std::string& reason)
+{
+  const NodeHeader* header = (const NodeHeader*)slot;
+  if (len < (int)sizeof(NodeHeader) || header->headsize != sizeof(NodeHeader))
+  {
+    reason = "headsize mismatch";
+    return false;
+  }
+  if (header->index != (shared ? SHARED_NODE_INDEX : (uint32_t)index))
+  {
+    reason = "index mismatch";
+    return false;
+  }
+  if (checksum::Compute(m_checksum, slot + sizeof(NodeHeader), len - sizeof(NodeHeader)) != header->crc)
+  {
+    reason = "crc mismatch";
+    return false;
+  }
+  return true;
+}
+
+int MyfilePartition::Scrub(const std::atomic<bool>* stop, int64_t bytesPerSecond, MyFileScrubCallback* callback)
+{
+  struct ScrubSlot
+  {
+    int64_t pos;
+    int64_t index;
+    uint16_t len;
+    uint16_t capacity;
+    bool shared;
+  };
+
+  // inline values are checked right away, the slots are read in file order afterwards
+  std::vector<ScrubSlot> slots;
+  std::vector<std::pair<int64_t, std::string>> bad;
+  std::set<int64_t> sharedSeen;
+  uv_mutex_lock(&m_fileLock);
+  if (!m_header)
+  {
+    uv_mutex_unlock(&m_fileLock);
+    return -1;
+  }
+  int32_t generation = m_dataGeneration;
+  std::string datapath = m_datapath;
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    int64_t base = (int64_t)m_pages[p]->page << INDEX_PAGE_BITS;
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      const KeyNode& node = m_pages[p]->node[n];
+      if (node.len == 0)
+        continue;
+      if (node.flag[1] == KNK_INLINE)
+      {
+        ++m_scrubSlots;
+        int valueLen = (int)node.len - (int)sizeof(NodeHeader);
+        if (valueLen < 0 || valueLen > INLINE_VALUE_LENGTH || checksum::Compute(m_checksum, node.value, valueLen) != node.crc)
+          bad.push_back(std::make_pair(base | n, std::string("inline crc mismatch")));
+        continue;
+      }
+      if (node.flag[1] == KNK_SHARED && !sharedSeen.insert(node.getPos()).second)
+        continue;
+
+      ScrubSlot slot;
+      slot.pos = node.getPos();
+      slot.index = base | n;
+      slot.len = node.len;
+      slot.capacity = node.capacity;
+      slot.shared = node.flag[1] == KNK_SHARED;
+      slots.push_back(slot);
+    }
+  }
+  uv_mutex_unlock(&m_fileLock);
+  std::sort(slots.begin(), slots.end(), [](const ScrubSlot& a, const ScrubSlot& b) { return a.pos < b.pos; });
+
+  // a handle of its own, reads do not take the partition lock. a compaction swapping the file ends the pass.
+#ifdef WIN32
+  File* file = new File(datapath, GENERIC_READ);
+#else
+  File* file = new File(datapath, O_RDONLY);
+#endif
+  char* buffer = new char[SCRUB_CHUNK_BYTES];
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  int64_t readBytes = 0;
+  for (size_t i = 0; file->IsValid() && i < slots.size() && !(stop && *stop);)
+  {
+    int64_t start = slots[i].pos;
+    size_t j = i + 1;
+    while (j < slots.size() && slots[j].pos + slots[j].capacity - start <= SCRUB_CHUNK_BYTES)
+      ++j;
+    int64_t end = slots[j - 1].pos + slots[j - 1].capacity;
+    int got = file->ReadUncached(start, buffer, (int)(end - start));
+
+    uv_mutex_lock(&m_fileLock);
+    bool swapped = generation != m_dataGeneration;
+    uv_mutex_unlock(&m_fileLock);
+    if (swapped)
+      break;
+
+    for (size_t k = i; k < j; ++k)
+    {
+      const ScrubSlot& slot = slots[k];
+      ++m_scrubSlots;
+      m_scrubBytes += slot.capacity;
+      std::string reason;
+      if (got >= slot.pos - start + slot.len && checkSlot(buffer + (slot.pos - start), slot.len, slot.index, slot.shared, reason))
+        continue;
+      if (reason.empty())
+        reason = "short read";
+
+      // the slot may have been released or rewritten since the snapshot, confirm under the lock
+      uv_mutex_lock(&m_fileLock);
+      KeyNode* node = findNode(slot.index);
+      bool current = node && generation == m_dataGeneration && node->len == slot.len && node->getPos() == slot.pos
+        && (node->flag[1] == KNK_SHARED) == slot.shared;
+      std::string confirmed;
+      if (current && (m_datafile->Read(slot.pos, m_buffer, slot.len) != slot.len || !checkSlot(m_buffer, slot.len, slot.index, slot.shared, confirmed)))
+        bad.push_back(std::make_pair(slot.index, confirmed.empty() ? reason : confirmed));
+      uv_mutex_unlock(&m_fileLock);
+    }
+    readBytes += end - start;
+    i = j;
+
+    // stay within the io budget
+    while (bytesPerSecond > 0 && !(stop && *stop))
+    {
+      int64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+      int64_t due = readBytes * 1000 / bytesPerSecond;
+      if (elapsed >= due)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min<int64_t>(due - elapsed, 100)));
+    }
+  }
+  delete[] buffer;
+  delete file;
+
+  for (size_t i = 0; i < bad.size(); ++i)
+  {
+    int64_t pos = getGlobalIndex(bad[i].first);
+    ++m_scrubBadSlots;
+    LOG(ERROR) << "scrub bad slot, partition: " << m_index << " index: " << pos << " " << bad[i].second;
+    if (callback)
+      callback->OnCorruptBlock(m_index, pos, bad[i].second);
+  }
+  return 0;
+}
+
+void MyfilePartition::removeCache(CacheValueHandle& handle)
+{
+  CacheValue* cache = m_cacheAllocator.getValue(handle);
+  if (!cache)
+    return;
+  if (cache->queue == CQ_WINDOW)
+    m_cacheWindow.Remove(cache);
+  else if (cache->queue == CQ_PROBATION)
+    m_cacheProbation.Remove(cache);
+  else if (cache->queue == CQ_PROTECTED)
+    m_cacheProtected.Remove(cache);
+  releaseCacheData(cache);
+  m_cacheAllocator.free(handle);
+  __atomic_store_n(&handle, CacheValueAllocator::INVALID_HANDLE, __ATOMIC_RELEASE);
+  --m_cacheNodeCount;
+}
+
+void MyfilePartition::evictCache()
+{
+  // a value hit without the lock is spared once, a bounded number of times per call
+  int spared = 0;
+  while (m_cacheNodeCount >= MAX_CACHE || m_cacheMemoryByte >= MAX_CACHE_LENGTH)
+  {
+    // the latest value admitted on probation against the oldest one there, the less frequent
+    // one goes. a scan never hits its values again and so does not push out the hot ones
+    CacheValue* victim = m_cacheProbation.tail;
+    CacheValue* candidate = m_cacheProbation.head;
+    if (!victim)
+      victim = candidate = m_cacheProtected.tail ? m_cacheProtected.tail : m_cacheWindow.tail;
+    if (!victim)
+      break;
+
+    CacheValue* touched = victim->touched.load(std::memory_order_relaxed) ? victim
+      : candidate->touched.load(std::memory_order_relaxed) ? candidate : nullptr;
+    if (touched && spared < MAX_CACHE_SPARED)
+    {
+      touched->touched.store(false, std::memory_order_relaxed);
+      touchCache(touched);
+      ++spared;
+      continue;
+    }
+
+    CacheValue* evicted = m_cacheSketch.Frequency(candidate->index) > m_cacheSketch.Frequency(victim->index) ? victim : candidate;
+    CacheValueHandle* handle = findHandle(evicted->index);
+    if (!handle || m_cacheAllocator.getValue(*handle) != evicted)
+    {
+      LOG(ERROR) << "cached value without its handle, index: " << evicted->index;
+      break;
+    }
+    removeCache(*handle);
+  }
+}
+
+void MyfilePartition::insertCache(CacheValue* cache, bool is_pread)
+{
+  if (!is_pread)
+    m_cacheSketch.Increment(cache->index);
+  m_cacheWindow.PushFront(cache, CQ_WINDOW);
+  // what leaves the window waits on probation until it is hit again or evicted
+  while (m_cacheWindow.count > 1 && m_cacheWindow.count * 100 > (int64_t)m_cacheNodeCount * CACHE_WINDOW_PERCENT)
+  {
+    CacheValue* oldest = m_cacheWindow.tail;
+    m_cacheWindow.Remove(oldest);
+    m_cacheProbation.PushFront(oldest, CQ_PROBATION);
+  }
+}
+
+void MyfilePartition::touchCache(CacheValue* cache)
+{
+  m_cacheSketch.Increment(cache->index);
+  if (cache->queue == CQ_WINDOW)
+  {
+    m_cacheWindow.Remove(cache);
+    m_cacheWindow.PushFront(cache, CQ_WINDOW);
+  }
+  else if (cache->queue == CQ_PROTECTED)
+  {
+    m_cacheProtected.Remove(cache);
+    m_cacheProtected.PushFront(cache, CQ_PROTECTED);
+  }
+  else if (cache->queue == CQ_PROBATION)
+  {
+    m_cacheProbation.Remove(cache);
+    m_cacheProtected.PushFront(cache, CQ_PROTECTED);
+    // the oldest protected values go back on probation when the segment outgrows its share
+    int64_t main = m_cacheProbation.count + m_cacheProtected.count;
+    while (m_cacheProtected.count > 1 && m_cacheProtected.count * 100 > main * CACHE_PROTECTED_PERCENT)
+    {
+      CacheValue* oldest = m_cacheProtected.tail;
+      m_cacheProtected.Remove(oldest);
+      m_cacheProbation.PushFront(oldest, CQ_PROBATION);
+    }
+  }
+}
+
+BlockBuffer* BlockBuffer::Create(const char* data, int32_t len)
+{
+  BlockBuffer* block = (BlockBuffer*)malloc(sizeof(BlockBuffer) + len);
+  new (&block->refs) std::atomic<int32_t>(1);
+  block->len = len;
+  if (data && len > 0)
+    memcpy(block->data(), data, len);
+  return block;
+}
+
+void BlockBuffer::Release()
+{
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    free(this);
+}
+
+int MyfilePartition::cacheBlock(int64_t index, const char* value, int len, bool rewrite_value, bool is_pread, const NodeHeader* pending, BlockBuffer* block)
+{
+  if (m_cacheMode != CM_CACHE)
+    return -1;
+
+  CacheValueHandle* node = findHandle(index);
+  if (!node)
+    return -1;
+
+  // may evict the value of index itself, it is cached again below
+  evictCache();
+
+  if (!rewrite_value && *node == CacheValueAllocator::INVALID_HANDLE)
+  {
+    //LOG(ERROR) << "myself poped when not rewrite, force rewrite_value = true, index." << index;
+    rewrite_value = true;
+  }
+
+  CacheValueHandle h = 0;
+  bool inserted = false;
+  if (*node == CacheValueAllocator::INVALID_HANDLE)
+  {
+    h = m_cacheAllocator.alloc();
+    if (h == CacheValueAllocator::INVALID_HANDLE)
+      return -1;
+    ++m_cacheNodeCount;
+    // published to readCachedValue, which loads the handles without the lock
+    __atomic_store_n(node, h, __ATOMIC_RELEASE);
+    inserted = true;
+  }
+  else if (is_pread)
+  {
+    //LOG(ERROR) << "pread node alread in cache, index." << index;
+    return -1;
+  }
+  else
+  {
+    h = *node;
+  }
+
+  CacheValue* cacheV = m_cacheAllocator.getValue(h);
+  if (!cacheV)
+    return -1;
+
+  if (rewrite_value)
+  {
+    releaseCacheData(cacheV);
+    cacheV->seq.WriteBegin();
+    cacheV->index = index;
+    // nodes of a shared slot share its cached copy
+    KeyNode* knode = findNode(index);
+    auto extent = knode && knode->flag[1] == KNK_SHARED && !pending ? m_sharedExtents.find(knode->getPos()) : m_sharedExtents.end();
+    if (extent != m_sharedExtents.end())
+    {
+      SharedBuffer*& buffer = m_sharedBuffers[extent->second.id];
+      if (!buffer)
+      {
+        buffer = new SharedBuffer();
+        buffer->extentId = extent->second.id;
+        buffer->refcount = 0;
+        buffer->len = len;
+        if (block)
+          block->AddRef();
+        buffer->block = block ? block : BlockBuffer::Create(value, len);
+        buffer->data = buffer->block->data();
+        m_cacheMemoryByte += buffer->len;
+      }
+      ++buffer->refcount;
+      buffer->block->AddRef();
+      cacheV->shared = buffer;
+      cacheV->block = buffer->block;
+      cacheV->data = buffer->data;
+      cacheV->len = buffer->len;
+    }
+    else
+    {
+      if (block)
+        block->AddRef();
+      cacheV->block = block ? block : BlockBuffer::Create(value, len);
+      cacheV->data = cacheV->block->data();
+      cacheV->len = len;
+      m_cacheMemoryByte += cacheV->len;
+    }
+    if (pending)
+    {
+      cacheV->pending = true;
+      cacheV->codec = pending->codec;
+      cacheV->dict = pending->dict;
+      cacheV->crc = pending->crc;
+    }
+    cacheV->seq.WriteEnd();
+  }
+
+  if (inserted)
+    insertCache(cacheV, is_pread);
+  else
+    touchCache(cacheV);
+  return 0;
+}
+
+void MyfilePartition::releaseCacheData(CacheValue* cache)
+{
+  cache->seq.WriteBegin();
+  if (cache->shared)
+  {
+    SharedBuffer* buffer = cache->shared;
+    if (--buffer->refcount == 0)
+    {
+      m_cacheMemoryByte -= buffer->len;
+      m_sharedBuffers.erase(buffer->extentId);
+      buffer->block->Release();
+      delete buffer;
+    }
+  }
+  else if (cache->block)
+  {
+    m_cacheMemoryByte -= cache->len;
+  }
+  // BlockRefs handed out keep the bytes until they are gone, hits without the lock until they left
+  if (cache->block)
+    retireBlock(cache->block);
+  cache->shared = 0;
+  cache->block = 0;
+  cache->data = 0;
+  cache->len = 0;
+  cache->pending = false;
+  cache->touched = false;
+  cache->seq.WriteEnd();
+}
+
+void MyfilePartition::retireBlock(BlockBuffer* block)
+{
+  m_reclaimer.Retire(block, [](void* p) { ((BlockBuffer*)p)->Release(); });
+}
+
+bool MyfilePartition::verifyCacheValue(int64_t index, CacheValue* cache)
+{
+  uint32_t crc = checksum::Compute(m_checksum, cache->data, cache->len);
+  if (crc != cache->crc)
+  {
+    LOG(ERROR) << "index: " << index << " prefetched crc failed!" << "datalen: " << cache->len << "oldcrc: " << cache->crc << "newcrc: " << crc;
+    return false;
+  }
+
+  std::string data;
+  bool decode = cache->codec != MC_RAW && cache->codec != MC_LEGACY;
+  if (decode && (!m_codec || !m_codec->Decompress(cache->codec, cache->dict, cache->data, cache->len, data)))
+  {
+    LOG(ERROR) << "index: " << index << " prefetched decode failed! codec: " << (int)cache->codec << " dict: " << (int)cache->dict;
+    return false;
+  }
+
+  cache->seq.WriteBegin();
+  if (decode)
+  {
+    m_cacheMemoryByte -= cache->len;
+    retireBlock(cache->block);
+    cache->block = BlockBuffer::Create(data.c_str(), data.length());
+    cache->data = cache->block->data();
+    cache->len = data.length();
+    m_cacheMemoryByte += cache->len;
+  }
+  cache->pending = false;
+  cache->seq.WriteEnd();
+  return true;
+}
+
+void MyfilePartition::lockFile()
+{
+  if (uv_mutex_trylock(&m_fileLock) != 0)
+  {
+    ++m_lockWaitCount;
+    uv_mutex_lock(&m_fileLock);
+  }
+}
+
+void MyfilePartition::GetShardStats(MyfileShardStats& stats)
+{
+  stats.reads = m_readCount;
+  stats.writes = m_writeCount;
+  stats.writeRuns = m_writeRuns;
+  stats.readRuns = m_readRuns;
+  stats.misses = m_missCount;
+  stats.lockWaits = m_lockWaitCount;
+  stats.bufferBytes = m_bufferPool.GetBytes();
+}
+
+std::string MyfilePartition::loadBlock(int16_t x, int16_t y, int16_t z, bool& bCacheHit)
+{
+  int64_t index = getLocalIndex(x, y, z);
+  if (index < 0)
+  {
+    //LOG(ERROR) << "loadBlock invalid x:" << x << "y : " << y << "z : " << z;
+    bCacheHit = true;
+    return "";
+  }
+
+  ++m_readCount;
+  std::string value;
+  if (readCachedValue(index, &value, nullptr))
+  {
+    bCacheHit = true;
+    return value;
+  }
+
+  lockFile();
+  // a read that raced a write of its slot is repeated under the lock
+  if (!loadNode(index, true, bCacheHit, value))
+    loadNode(index, false, bCacheHit, value);
+  uv_mutex_unlock(&m_fileLock);
+  if (!bCacheHit)
+    ++m_missCount;
+  return value;
+}
+
+bool MyfilePartition::loadNode(int64_t index, bool unlocked, bool& bCacheHit, std::string& value)
+{
+  bCacheHit = true;
+  KeyNode* pnode = findNode(index);
+  if (!pnode || pnode->len == 0)  // not exist
+  {
+    value.clear();
+    return true;
+  }
+  KeyNode& node = *pnode;
+
+  if (node.flag[1] == KNK_INLINE)  // read from the index, not cached
+  {
+    value = readInlineNode(node, index);
+    return true;
+  }
+
+  CacheValueHandle* handle = findHandle(index);
+  CacheValue* cache = handle && *handle != CacheValueAllocator::INVALID_HANDLE ? m_cacheAllocator.getValue(*handle) : nullptr;
+  if (cache && (!cache->pending || verifyCacheValue(index, cache)))  // read from cache
+  {
+    value.assign(cache->data, cache->len);
+    cacheBlock(index, value.c_str(), value.length(), false, false);
+    return true;
+  }
+
+  bCacheHit = false;
+  int64_t pos = node.getPos();
+  int readPos = 0;
+  if (m_mappedReads && mapDataFile(pos + node.capacity))
+  {
+    // the readahead stops at the end of the file
+    int readBytes = (int)std::min<int64_t>(ROUND(node.capacity, 4096 * 2), m_dataMapLength - pos);
+    value = ProcessReadBuffer(m_dataMap + pos, readBytes, readPos, pos, index);
+    return true;
+  }
+
+  // O_DIRECT reads whole pages, the slot starts skip bytes into them
+  int skip = m_directfile ? pos % DIRECT_IO_ALIGN : 0;
+  int size = ROUND(node.capacity, 4096 * 2);
+  if (!unlocked)
+  {
+    int readBytes = m_directfile ? m_directfile->Read(pos - skip, m_buffer, ROUND(skip + size, DIRECT_IO_ALIGN)) - skip
+      : m_datafile->Read(pos, m_buffer, size);
+    if (readBytes < 0)
+      readBytes = 0;
+    value = ProcessReadBuffer(m_buffer + skip, readBytes, readPos, pos, index);
+    return true;
+  }
+
+  // the read goes to a buffer of its own without m_fileLock, m_swapLock keeps the handle open
+  KeyNode read = node;
+  int32_t generation = m_dataGeneration;
+  uint32_t* versions = findPage(index)->version;
+  uint32_t version = versions[index & (INDEX_PAGE_NODES - 1)];
+  File* file = m_directfile ? m_directfile : m_datafile;
+  int bytes = m_directfile ? ROUND(skip + size, DIRECT_IO_ALIGN) : size;
+  uv_rwlock_rdlock(&m_swapLock);
+  uv_mutex_unlock(&m_fileLock);
+
+  char* buffer = m_bufferPool.Alloc(READ_BUFFER_BYTES);
+  int readBytes = buffer ? file->Read(pos - skip, buffer, bytes) - skip : 0;
+  if (readBytes < 0)
+    readBytes = 0;
+  uv_rwlock_rdunlock(&m_swapLock);
+
+  lockFile();
+  // the slot still holds what was read when the node was neither written nor deleted and the
+  // file did not change. the node only points at a slot freed and reused meanwhile after a write
+  // of its own, which bumps the version.
+  KeyNode* current = findNode(index);
+  bool valid = buffer && current && generation == m_dataGeneration && version == versions[index & (INDEX_PAGE_NODES - 1)]
+    && current->getPos() == pos && current->len == read.len && current->capacity == read.capacity
+    && current->flag[1] == read.flag[1];
+  if (valid)
+    value = ProcessReadBuffer(buffer + skip, readBytes, readPos, pos, index);
+  m_bufferPool.Free(buffer, READ_BUFFER_BYTES);
+  return valid;
+}
+
+BlockRef MyfilePartition::loadBlockRef(int16_t x, int16_t y, int16_t z, bool& bCacheHit)
+{
+  int64_t index = getLocalIndex(x, y, z);
+  BlockRef ref;
+  if (readCachedValue(index, nullptr, &ref))
+  {
+    ++m_readCount;
+    bCacheHit = true;
+    return ref;
   }
 
-  if (ret)
+  if (index < 0)
   {
-    cacheBlock(index, data, true, false);
-    m_datafile->TryFlush(node.getPos(), capacity);
+    bCacheHit = true;
+    return ref;
   }
-  else
+
+  // a pending value is verified under the lock
+  ++m_readCount;
+  lockFile();
+  KeyNode* node = findNode(index);
+  CacheValueHandle* handle = node && node->len != 0 && node->flag[1] != KNK_INLINE ? findHandle(index) : nullptr;
+  CacheValue* cache = handle && *handle != CacheValueAllocator::INVALID_HANDLE ? m_cacheAllocator.getValue(*handle) : nullptr;
+  if (cache && (!cache->pending || verifyCacheValue(index, cache)))
   {
-    LOG(ERROR) << "saveBlock write fail! index: " << globalIndex;
+    bCacheHit = true;
+    cache->block->AddRef();
+    ref = BlockRef(cache->block);
+    touchCache(cache);
+    uv_mutex_unlock(&m_fileLock);
+    return ref;
   }
 
+  // inline values, misses and missing blocks
+  std::string value;
+  if (!loadNode(index, true, bCacheHit, value))
+    loadNode(index, false, bCacheHit, value);
+  if (!bCacheHit)
+    ++m_missCount;
+
+  // a miss installed its value in the cache under the lock still held, the ref shares that buffer
+  handle = value.empty() ? nullptr : findHandle(index);
+  cache = handle && *handle != CacheValueAllocator::INVALID_HANDLE ? m_cacheAllocator.getValue(*handle) : nullptr;
+  if (cache && cache->index == index && !cache->pending && cache->block && cache->len == (int)value.length())
+  {
+    cache->block->AddRef();
+    ref = BlockRef(cache->block);
+  }
   uv_mutex_unlock(&m_fileLock);
 
-  return ret;
+  if (!ref.get() && !value.empty())
+    ref = BlockRef(BlockBuffer::Create(value.c_str(), value.length()));
+  return ref;
 }
 
-int32_t MyfilePartition::getLocalIndex(int16_t x, int16_t y, int16_t z)
-{ 
-  if (x < 0 || z < 0)
+bool MyfilePartition::readCachedValue(int64_t index, std::string* value, BlockRef* ref)
+{
+  IndexPage* page = m_cacheMode == CM_CACHE ? findPage(index) : nullptr;
+  if (!page || !page->handle)
+    return false;
+
+  // the node and its cache entry are read without the lock, a write overlapping the reads fails it
+  int n = index & (INDEX_PAGE_NODES - 1);
+  int token = m_reclaimer.Enter();
+  uint32_t nodeSeq = page->seq.ReadBegin();
+  bool slot = page->node[n].len != 0 && page->node[n].flag[1] != KNK_INLINE;
+  CacheValue* cache = m_cacheAllocator.getValue(__atomic_load_n(&page->handle[n], __ATOMIC_ACQUIRE));
+  uint32_t cacheSeq = cache ? cache->seq.ReadBegin() : 0;
+  BlockBuffer* block = cache && cache->index == index && !cache->pending ? cache->block : nullptr;
+  bool hit = slot && block && cache->seq.ReadValid(cacheSeq) && page->seq.ReadValid(nodeSeq);
+  if (hit)
   {
-    return -1;
+    // a block the cache dropped meanwhile is only released after Exit
+    if (value)
+      value->assign(block->data(), block->len);
+    if (ref)
+    {
+      block->AddRef();
+      *ref = BlockRef(block);
+    }
+    // the eviction order is updated under the lock
+    if (!cache->touched.load(std::memory_order_relaxed))
+      cache->touched.store(true, std::memory_order_relaxed);
   }
+  m_reclaimer.Exit(token);
+  return hit;
+}
+
+bool MyfilePartition::loadCachedBlock(int16_t x, int16_t y, int16_t z, std::string& value)
+{
+  value.clear();
+  int64_t index = getLocalIndex(x, y, z);
+  if (index < 0)
+    return true;
 
-  int16_t local_x = x / MYSQL_BLOCK_TABLE_NUM;
-  int16_t local_y = y + 14;
-  int16_t local_z = z;
-  if (local_z < 0 || local_z >= 1024)
+  if (readCachedValue(index, &value, nullptr))
   {
-    //LOG(ERROR) << "invalid local_z:" << z;
-    return -1;
+    ++m_readCount;
+    return true;
   }
-  if (local_y < 0 || local_y >= 23)
+  if (uv_mutex_trylock(&m_fileLock) != 0)
+    return false;
+  bool hit = true;
+  KeyNode* pnode = findNode(index);
+  if (pnode && pnode->len != 0 && pnode->flag[1] == KNK_INLINE)
   {
-    //LOG(ERROR) << "invalid local_y:" << local_y;
-    return -1;
+    value = readInlineNode(*pnode, index);
   }
-  if (local_x < 0 || local_x >= 64)
+  else if (pnode && pnode->len != 0)
   {
-    //LOG(ERROR) << "invalid local_x:" << local_x;
-    return -1;
+    CacheValueHandle* handle = findHandle(index);
+    CacheValue* cache = handle && *handle != CacheValueAllocator::INVALID_HANDLE ? m_cacheAllocator.getValue(*handle) : nullptr;
+    hit = cache && (!cache->pending || verifyCacheValue(index, cache));
+    if (hit)
+    {
+      value.assign(cache->data, cache->len);
+      cacheBlock(index, value.c_str(), value.length(), false, false);
+    }
   }
-  return local_z + (local_x << 10) + (local_y << 16);
+  uv_mutex_unlock(&m_fileLock);
+  if (hit)
+    ++m_readCount;
+  return hit;
 }
 
-int64_t MyfilePartition::getGlobalIndex(int32_t localindex)
+bool MyfilePartition::SetDirectIO(bool direct)
 {
-  int16_t z = localindex & 1023;
-  localindex = localindex >> 10;
-  int16_t x = localindex & 63;
-  localindex = localindex >> 6;
-  int16_t y = localindex;
-  return Database::getBlockAsInteger(x * MYSQL_BLOCK_TABLE_NUM + m_index, y - 14, z);
+  lockFile();
+  m_directIO = direct;
+  uv_rwlock_wrlock(&m_swapLock);
+  bool ret = openDirectFile();
+  uv_rwlock_wrunlock(&m_swapLock);
+  uv_mutex_unlock(&m_fileLock);
+  return ret;
 }
 
-void MyfilePartition::flush()
+void MyfilePartition::SetMappedReads(bool mapped)
 {
-  uv_mutex_lock(&m_fileLock);
-  bool onlyData = !m_metadataChanged;
-  m_metadataChanged = false;
+  lockFile();
+  m_mappedReads = mapped;
+  if (!mapped)
+    unmapDataFile();
   uv_mutex_unlock(&m_fileLock);
-  if (m_datafile)
-    m_datafile->Flush(onlyData);
-
-#ifdef WIN32
-  if (m_header)
-  {
-    BOOL b = FlushViewOfFile(m_header, VALUE_OFFSET); 
-    if (!b)
-      LOG(ERROR) << "FlushViewOfFile error!";
-  }
-#else
-  if (m_header)
-    msync((void *)m_header, VALUE_OFFSET, MS_SYNC);
-#endif  //! #ifdef WIN32
 }
 
-#define CHECK_DELETE(p) \
-CacheValue* cache = m_cacheAllocator.getValue(p);\
-if (cache && --(cache)->refcount == 0) \
-{ \
-  m_cacheMemoryByte -= cache->len;\
-  cache->len = 0;\
-  free(cache->data);\
-  cache->data = 0;\
-  m_cacheAllocator.free(p); \
-  (p) = CacheValueAllocator::INVALID_HANDLE; \
-  --m_cacheNodeCount; \
-}
-
-int32_t MyfilePartition::AllocCacheIndex()
+bool MyfilePartition::mapDataFile(int64_t end)
 {
-  int32_t index = -1;
-  if (m_prereadCacheFIFO.size() > 1024)
-  {
-    index = m_prereadCacheFIFO.front();
-    m_prereadCacheFIFO.pop_front();
-    return index;
-  }
+  if (end <= m_dataMapLength)
+    return true;
+  int64_t length = m_datafile ? m_datafile->GetLength() : 0;
+  if (end > length)
+    return false;
 
-  if (!m_accessCacheFIFO.empty())
+  // slots are written before their node points at them, so the view only grows with the file
+  if (length > m_dataMapBytes)
   {
-    index = m_accessCacheFIFO.front();
-    m_accessCacheFIFO.pop_front();
+    unmapDataFile();
+#ifdef WIN32
+    int64_t bytes = length;  // a read-only view can not reach past the file
+#else
+    int64_t bytes = ROUND(length + DATA_MAP_RESERVE_BYTES, 65536);
+#endif
+    m_dataMap = (char*)MapFileRegion(m_datafile, 0, bytes, false);
+    if (!m_dataMap)
+    {
+      LOG(ERROR) << "Unable to mmap data file: " << m_datapath;
+      return false;
+    }
+    m_dataMapBytes = bytes;
   }
-  return index;
+  m_dataMapLength = length;
+  return true;
 }
 
-int MyfilePartition::cacheBlock(int32_t index, const std::string& value, bool rewrite_value, bool is_pread)
+void MyfilePartition::unmapDataFile()
 {
-  if (!m_node || m_cacheMode != CM_CACHE)
-    return -1;
+  if (m_dataMap)
+    UnmapFileRegion(m_dataMap, m_dataMapBytes);
+  m_dataMap = nullptr;
+  m_dataMapBytes = 0;
+  m_dataMapLength = 0;
+}
 
-  while (m_cacheNodeCount >= MAX_CACHE || m_cacheMemoryByte >= MAX_CACHE_LENGTH)
-  {
-    int32_t newIndex = AllocCacheIndex();
-    CHECK_DELETE(m_node[newIndex]);
-  }
+bool MyfilePartition::openDirectFile()
+{
+  delete m_directfile;
+  m_directfile = nullptr;
+  if (!m_directIO || !m_datafile)
+    return !m_directIO;
 
-  if (!rewrite_value && m_node[index] == CacheValueAllocator::INVALID_HANDLE)
+#ifdef WIN32
+  LOG(ERROR) << "direct io not supported: " << m_datapath;
+  return false;
+#else
+  m_directfile = new File(m_datapath, O_RDONLY | O_DIRECT);
+  if (!m_directfile->IsValid())
   {
-    //LOG(ERROR) << "myself poped when not rewrite, force rewrite_value = true, index." << index;
-    rewrite_value = true;
+    LOG(ERROR) << "Unable to open with O_DIRECT: " << m_datapath;
+    delete m_directfile;
+    m_directfile = nullptr;
+    return false;
   }
+  // what the buffered reads cached so far
+  m_datafile->DropCache();
+  return true;
+#endif
+}
 
-  CacheValueHandle h = 0;
-  if (m_node[index] == CacheValueAllocator::INVALID_HANDLE)
-  {
-    h = m_cacheAllocator.alloc();
-    ++m_cacheNodeCount;
-    m_node[index] = h;
-  }
-  else if (is_pread)
+int MyfilePartition::loadBlocks(const std::vector<std::pair<int64_t, std::string*>>& blocks)
+{
+  struct Miss
   {
-    //LOG(ERROR) << "pread node alread in cache, index." << index;
-    return -1;
-  }
-  else
+    int64_t index;
+    int64_t pos;
+    int32_t capacity;
+    uint16_t len;
+    char kind;
+    uint32_t version;
+    std::string* value;
+  };
+  std::vector<Miss> misses;
+  int hits = 0;
+
+  m_readCount += blocks.size();
+  lockFile();
+  for (size_t i = 0; i < blocks.size(); ++i)
   {
-    h = m_node[index];
-  }
-
-  CacheValue* cacheV = m_cacheAllocator.getValue(h);
-  if (!cacheV)
-    return -1;
+    int16_t x, y, z;
+    Database::getIntegerAsBlock(blocks[i].first, x, y, z);
+    int64_t index = getLocalIndex(x, y, z);
+    std::string& value = *blocks[i].second;
+    KeyNode* node = index >= 0 ? findNode(index) : nullptr;
+    ++hits;
+    if (!node || node->len == 0)
+    {
+      value.clear();
+      continue;
+    }
+    if (node->flag[1] == KNK_INLINE)
+    {
+      value = readInlineNode(*node, index);
+      continue;
+    }
 
-  if (rewrite_value)
-  {
-    m_cacheMemoryByte -= cacheV->len;
-    if (cacheV->data)
-      free(cacheV->data);
-    cacheV->data = (char*)malloc(value.length());
-    memcpy(cacheV->data, value.c_str(), value.length());
-    cacheV->len = value.length();
-    m_cacheMemoryByte += cacheV->len;
-  }
+    CacheValueHandle* handle = findHandle(index);
+    CacheValue* cache = handle && *handle != CacheValueAllocator::INVALID_HANDLE ? m_cacheAllocator.getValue(*handle) : nullptr;
+    if (cache && (!cache->pending || verifyCacheValue(index, cache)))
+    {
+      value.assign(cache->data, cache->len);
+      cacheBlock(index, value.c_str(), value.length(), false, false);
+      continue;
+    }
 
-  if (cacheV->refcount < 3)
-  {
-    if (is_pread)
-      m_prereadCacheFIFO.push_back(index);
-    else
-      m_accessCacheFIFO.push_back(index);
-    ++cacheV->refcount;
+    --hits;
+    Miss miss = { index, node->getPos(), node->capacity, node->len, node->flag[1],
+      findPage(index)->version[index & (INDEX_PAGE_NODES - 1)], &value };
+    misses.push_back(miss);
   }
-  
-  return 0;
-}
-
-std::string MyfilePartition::loadBlock(int16_t x, int16_t y, int16_t z, bool& bCacheHit)
-{
-  int32_t index = getLocalIndex(x, y, z);
-  if (index < 0 || index >= MAX_NODE)
+  m_missCount += misses.size();
+
+  std::sort(misses.begin(), misses.end(), [](const Miss& a, const Miss& b) { return a.pos < b.pos; });
+  // slots close to each other share one read, the gap between them is read along. O_DIRECT runs
+  // cover whole pages, so every run also starts the buffer at a page boundary. the runs stay
+  // aligned with mapped reads on, the mapping can fail and send them to the O_DIRECT handle.
+  File* file = m_directfile ? m_directfile : m_datafile;
+  int64_t align = file == m_directfile ? DIRECT_IO_ALIGN : 1;
+  std::vector<FileRequest> reads;
+  std::vector<size_t> firstMiss;
+  for (size_t i = 0; i < misses.size();)
   {
-    //LOG(ERROR) << "loadBlock invalid x:" << x << "y : " << y << "z : " << z;
-    bCacheHit = true;
-    return "";
+    FileRequest read;
+    read.offset = misses[i].pos / align * align;
+    read.data = nullptr;
+    read.result = -1;
+    int64_t end = misses[i].pos + misses[i].capacity;
+    firstMiss.push_back(i);
+    for (++i; i < misses.size(); ++i)
+    {
+      int64_t next = std::max(end, misses[i].pos + misses[i].capacity);
+      if (misses[i].pos - end > MAX_READ_GAP_BYTES || next - read.offset > MAX_READ_RUN_BYTES)
+        break;
+      end = next;
+    }
+    read.size = (int)ROUND(end - read.offset, align);
+    reads.push_back(read);
   }
-
-  uv_mutex_lock(&m_fileLock);
-  KeyNode& node = m_header->node[index];
-  if (node.len == 0)  // not exist
+  firstMiss.push_back(misses.size());
+
+  // the runs are read a chunk at a time, so the buffer stays bounded. a mapped file serves them in
+  // place under the lock, otherwise they are read without m_fileLock and every run of the chunk is
+  // in flight at once when the partition has a ring.
+  int32_t generation = m_dataGeneration;
+  bool released = false;
+  for (size_t first = 0; first < reads.size();)
   {
-    bCacheHit = true;
-    uv_mutex_unlock(&m_fileLock);
-    return "";
-  }
+    size_t last = first;
+    int chunkBytes = 0;
+    while (last < reads.size() && (last == first || chunkBytes + reads[last].size <= MAX_READ_CHUNK_BYTES))
+      chunkBytes += reads[last++].size;
+
+    // a compaction or a switch of the read mode while the lock was released leaves the positions
+    // or the alignment of the runs behind, their misses are read one by one under the lock
+    bool stale = generation != m_dataGeneration || file != (m_directfile ? m_directfile : m_datafile);
+    char* pooled = nullptr;
+    bool unlocked = false;
+    const Miss& lastMiss = misses[firstMiss[last] - 1];
+    if (!stale && m_mappedReads && mapDataFile(lastMiss.pos + lastMiss.capacity))
+    {
+      for (size_t r = first; r < last; ++r)
+      {
+        reads[r].data = m_dataMap + reads[r].offset;
+        reads[r].result = (int)std::min<int64_t>(reads[r].size, m_dataMapLength - reads[r].offset);
+      }
+    }
+    else if (!stale)
+    {
+      // m_swapLock keeps the handle open. m_ringLock is taken without m_fileLock and held until
+      // the ring buffer is consumed
+      unlocked = released = true;
+      uv_rwlock_rdlock(&m_swapLock);
+      uv_mutex_unlock(&m_fileLock);
+      if (m_ring)
+        uv_mutex_lock(&m_ringLock);
+      char* buffer = m_ring ? m_ring->Buffer(chunkBytes) : nullptr;
+      if (!buffer)
+        buffer = pooled = m_bufferPool.Alloc(chunkBytes);
+      for (size_t r = first; buffer && r < last; ++r)
+      {
+        reads[r].data = buffer;
+        buffer += reads[r].size;
+      }
+      if (reads[first].data)
+        file->ReadBatch(&reads[first], (int)(last - first), m_ring);
+      m_readRuns += last - first;
+      uv_rwlock_rdunlock(&m_swapLock);
+      lockFile();
+    }
 
-  if (m_node && m_node[index] != CacheValueAllocator::INVALID_HANDLE)  // read from cache
-  {
-    bCacheHit = true;
-    CacheValue* cache = m_cacheAllocator.getValue(m_node[index]);
-    std::string val(cache->data, cache->len);
-    cacheBlock(index, val, false, false);
-    uv_mutex_unlock(&m_fileLock);
-    return val;
+    for (size_t r = first; r < last; ++r)
+    {
+      int64_t start = reads[r].offset;
+      int readBytes = reads[r].result;
+      for (size_t i = firstMiss[r]; i < firstMiss[r + 1]; ++i)
+      {
+        const Miss& miss = misses[i];
+        const KeyNode* node = findNode(miss.index);
+        // a slot written, deleted or moved while the lock was released is read again under it
+        if (stale || (released && (!node || generation != m_dataGeneration || node->getPos() != miss.pos
+          || node->len != miss.len || node->capacity != miss.capacity || node->flag[1] != miss.kind
+          || findPage(miss.index)->version[miss.index & (INDEX_PAGE_NODES - 1)] != miss.version)))
+        {
+          bool cacheHit = false;
+          loadNode(miss.index, false, cacheHit, *miss.value);
+          continue;
+        }
+
+        const char* slot = reads[r].data ? reads[r].data + (miss.pos - start) : nullptr;
+        std::string reason = "short read";
+        *miss.value = "ERROR";
+        if (readBytes < miss.pos - start + node->len
+          || !checkSlot(slot, node->len, miss.index, node->flag[1] == KNK_SHARED, reason))
+        {
+          LOG(ERROR) << "index: " << miss.index << " " << reason;
+          continue;
+        }
+
+        const NodeHeader* header = (const NodeHeader*)slot;
+        const char* value = slot + sizeof(NodeHeader);
+        int valueLen = node->len - sizeof(NodeHeader);
+        if (header->codec == MC_RAW || header->codec == MC_LEGACY)
+        {
+          miss.value->assign(value, valueLen);
+        }
+        else if (!m_codec || !m_codec->Decompress(header->codec, header->dict, value, valueLen, *miss.value))
+        {
+          LOG(ERROR) << "index: " << miss.index << " decode failed! codec: " << (int)header->codec << " dict: " << (int)header->dict;
+          *miss.value = "ERROR";
+          continue;
+        }
+        cacheBlock(miss.index, miss.value->c_str(), miss.value->length(), true, false);
+      }
+    }
+    m_bufferPool.Free(pooled, chunkBytes);
+    if (unlocked && m_ring)
+      uv_mutex_unlock(&m_ringLock);
+    first = last;
   }
-
-  bCacheHit = false;
-  int readBytes = m_datafile->Read(node.getPos(), m_buffer, ROUND(node.capacity, 4096 * 2));
-  int readPos = 0;
-  std::string ret = ProcessReadBuffer(readBytes, readPos, index);
   uv_mutex_unlock(&m_fileLock);
-  return ret;
+  return hits;
 }
 
 std::string MyfilePartition::__directLoadBlock(int16_t x, int16_t y, int16_t z, bool& changed)
@@ -529,8 +2799,10 @@ std::string MyfilePartition::__directLoadBlock(int16_t x, int16_t y, int16_t z,
   std::string data = loadBlock(x, y, z, bCacheHit);
   if (!data.empty())
   {
-    int32_t index = getLocalIndex(x, y, z);
-    changed = m_header->node[index].flag[0] == 0;
+    uv_mutex_lock(&m_fileLock);
+    KeyNode* node = findNode(getLocalIndex(x, y, z));
+    changed = node && node->flag[0] == 0;
+    uv_mutex_unlock(&m_fileLock);
   }
   else
   {
@@ -539,14 +2811,18 @@ std::string MyfilePartition::__directLoadBlock(int16_t x, int16_t y, int16_t z,
   return data;
 }
 
-std::string MyfilePartition::ProcessReadBuffer(int& readBytes, int& readPos, int index)
+std::string MyfilePartition::ProcessReadBuffer(const char* buffer, int& readBytes, int& readPos, int64_t bufferPos, int64_t index)
 {
   std::string ret = "ERROR";
 
-  if (readBytes < sizeof(NodeHeader))
+  // a following node only counts when its current slot is the one in the buffer
+  KeyNode* node = findNode(index);
+  if (!node || readBytes < (int)sizeof(NodeHeader) || node->len < sizeof(NodeHeader) || node->flag[1] == KNK_INLINE)
+    return ret;
+  if (readPos != 0 && (node->getPos() != bufferPos + readPos || m_cacheMode != CM_CACHE))
     return ret;
 
-  NodeHeader* header = (NodeHeader*)(m_buffer + readPos);
+  const NodeHeader* header = (const NodeHeader*)(buffer + readPos);
   uint32_t saveIndex = 0;
   uint32_t saveCrc = 0;
   uint32_t headSize = 0;
@@ -563,78 +2839,161 @@ std::string MyfilePartition::ProcessReadBuffer(int& readBytes, int& readPos, int
     return ret;
   }
 
-  if (index != saveIndex)
+  if ((uint32_t)index != saveIndex && !(node->flag[1] == KNK_SHARED && saveIndex == SHARED_NODE_INDEX))
   {
     if (readPos == 0)
       LOG(ERROR) << "index: " << index << " not match!";
     return ret;
   }
 
-  if (readBytes < m_header->node[index].capacity)
+  if (readBytes < node->capacity)
   {
     if (readPos == 0)
-      LOG(ERROR) << "index: " << index << " need capacity:" << m_header->node[index].capacity;
+      LOG(ERROR) << "index: " << index << " need capacity:" << node->capacity;
     return ret;
   }
 
-  std::string data = std::string(m_buffer + readPos + headSize, m_header->node[index].len - headSize);
-  uint32_t crc = 0;
-  if (!data.empty())
+  const char* value = buffer + readPos + headSize;
+  int valueLen = node->len - headSize;
+  if (readPos != 0 && m_lazyVerify && node->flag[1] == KNK_SLOT)
   {
-    boost::crc_32_type crc32;
-    crc32.process_bytes(data.c_str(), data.length());
-    crc = crc32();
+    // nobody asked for it yet, verified and decoded by the load that hits it
+    cacheBlock(index, value, valueLen, true, true, header);
+    readBytes -= node->capacity;
+    readPos += node->capacity;
+    ProcessReadBuffer(buffer, readBytes, readPos, bufferPos, index + 1);
+    return ret;
   }
 
+  uint32_t crc = checksum::Compute(m_checksum, value, valueLen);
   if (saveCrc != crc)
   {
     if (readPos == 0)
-      LOG(ERROR) << "index: " << index << " crc failed!" << "datalen: " << data.length() << "oldcrc: " << saveCrc << "newcrc: " << crc;
+      LOG(ERROR) << "index: " << index << " crc failed!" << "datalen: " << valueLen << "oldcrc: " << saveCrc << "newcrc: " << crc;
+    return ret;
+  }
+
+  std::string data;
+  if (header->codec == MC_RAW || header->codec == MC_LEGACY)
+  {
+    data.assign(value, valueLen);
+  }
+  else if (!m_codec || !m_codec->Decompress(header->codec, header->dict, value, valueLen, data))
+  {
+    if (readPos == 0)
+      LOG(ERROR) << "index: " << index << " decode failed! codec: " << (int)header->codec << " dict: " << (int)header->dict;
     return ret;
   }
 
   //LOG(ERROR) << "precache index: " << index;
-  cacheBlock(index, data, true, readPos != 0);
+  cacheBlock(index, data.c_str(), data.length(), true, readPos != 0);
 
   ret = data;
-  readBytes -= m_header->node[index].capacity;
-  readPos += m_header->node[index].capacity;
+  readBytes -= node->capacity;
+  readPos += node->capacity;
 
-  ProcessReadBuffer(readBytes, readPos, index + 1);
+  ProcessReadBuffer(buffer, readBytes, readPos, bufferPos, index + 1);
   return ret;
 }
 
+std::string MyfilePartition::readInlineNode(const KeyNode& node, int64_t index)
+{
+  std::string ret = "ERROR";
+  int valueLen = (int)node.len - (int)sizeof(NodeHeader);
+  if (valueLen < 0 || valueLen > INLINE_VALUE_LENGTH)
+  {
+    LOG(ERROR) << "index: " << index << " inline len: " << node.len << " invalid!";
+    return ret;
+  }
+
+  uint32_t crc = checksum::Compute(m_checksum, node.value, valueLen);
+  if (node.crc != crc)
+  {
+    LOG(ERROR) << "index: " << index << " inline crc failed!" << "datalen: " << valueLen << "oldcrc: " << node.crc << "newcrc: " << crc;
+    return ret;
+  }
+
+  std::string data;
+  if (node.codec == MC_RAW)
+  {
+    data.assign(node.value, valueLen);
+  }
+  else if (!m_codec || !m_codec->Decompress(node.codec, node.dict, node.value, valueLen, data))
+  {
+    LOG(ERROR) << "index: " << index << " inline decode failed! codec: " << (int)node.codec << " dict: " << (int)node.dict;
+    return ret;
+  }
+  return data;
+}
+
 bool MyfilePartition::deleteBlock(int16_t x, int16_t y, int16_t z)
 {
-  int32_t index = getLocalIndex(x, y, z);
-  if (index < 0 || index >= MAX_NODE)
+  int64_t index = getLocalIndex(x, y, z);
+  if (index < 0)
   {
     //LOG(ERROR) << "loadBlock invalid x:" << x << "y : " << y << "z : " << z;
     return "";
   }
 
-  uv_mutex_lock(&m_fileLock);
-  KeyNode& node = m_header->node[index];
+  ++m_writeCount;
+  lockFile();
+  KeyNode* pnode = findNode(index);
+  if (!pnode)
+  {
+    uv_mutex_unlock(&m_fileLock);
+    return true;
+  }
+  KeyNode& node = *pnode;
+  markDirty(index);
   if (node.len != 0)
+  {
     --m_header->count;
+    m_headerDirty = std::max(m_headerDirty, HEADER_FIELD_BYTES);
+    if (node.flag[1] == KNK_SLOT)
+      m_liveBytes -= ROUND(node.len, 1024);
+  }
+  if (m_compacting)
+    m_compactDirty.push_back(index);
+  IndexPage* page = findPage(index);
+  page->seq.WriteBegin();
+  ++page->version[index & (INDEX_PAGE_NODES - 1)];
   node.len = 0;
+  releaseSlot(node);
+  page->seq.WriteEnd();
+  m_metadataChanged = true;
   uv_mutex_unlock(&m_fileLock);
   return true;
 }
 
 bool MyfilePartition::GetModifyList(std::vector<int64_t>& v)
 {
-  for (int i = 0; i < MAX_NODE; ++i)
+  uv_mutex_lock(&m_fileLock);
+  for (size_t p = 0; p < m_pages.size(); ++p)
   {
-    KeyNode& node = m_header->node[i];
-    if (node.flag[0] != 0)
-      v.push_back(getGlobalIndex(i));
+    int64_t base = (int64_t)m_pages[p]->page << INDEX_PAGE_BITS;
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      if (m_pages[p]->node[n].flag[0] != 0)
+        v.push_back(getGlobalIndex(base | n));
+    }
   }
+  uv_mutex_unlock(&m_fileLock);
   return true;
 }
 
 bool MyfilePartition::listAllLoadableBlocks(std::vector<int64_t> &dst)
 {
+  uv_mutex_lock(&m_fileLock);
+  for (size_t p = 0; p < m_pages.size(); ++p)
+  {
+    int64_t base = (int64_t)m_pages[p]->page << INDEX_PAGE_BITS;
+    for (int n = 0; n < INDEX_PAGE_NODES; ++n)
+    {
+      if (m_pages[p]->node[n].len != 0)
+        dst.push_back(getGlobalIndex(base | n));
+    }
+  }
+  uv_mutex_unlock(&m_fileLock);
   return true;
 }
 
@@ -655,44 +3014,384 @@ Database_Myfile::Database_Myfile(const std::string &savedir, const std::string &
   m_savedir = savedir;
   m_dbfile = dbfile;
 
-  m_wheelIndex = 0;
-  uv_mutex_init(&m_cacheLock);
-  uv_mutex_init(&m_flushLock);
-}
+  m_wheelIndex = 0;
+  m_shardCount = 0;
+  m_shardPolicy = -1;
+  m_shardFunction = nullptr;
+  m_dedup = false;
+  m_lazyVerify = true;
+  m_directIO = false;
+  m_mappedReads = false;
+  m_walEnabled = false;
+  m_compactStop = false;
+  m_compactPartition = -1;
+  m_compactedPartitions = 0;
+  m_compactReclaimedBytes = 0;
+  m_scrubStop = false;
+  m_scrubRunning = false;
+  m_scrubPartition = -1;
+  m_scrubPasses = 0;
+  m_scrubCallback = nullptr;
+  m_asyncDone = nullptr;
+  m_asyncStop = true;
+  uv_mutex_init(&m_cacheLock);
+  uv_mutex_init(&m_flushLock);
+  uv_rwlock_init(&m_walLock);
+  uv_mutex_init(&m_asyncLock);
+  uv_cond_init(&m_asyncCond);
+  uv_cond_init(&m_asyncShares);
+}
+
+Database_Myfile::~Database_Myfile()
+{
+  UnInit();
+  uv_mutex_destroy(&m_cacheLock);
+  uv_mutex_destroy(&m_flushLock);
+  uv_rwlock_destroy(&m_walLock);
+  uv_cond_destroy(&m_asyncShares);
+  uv_cond_destroy(&m_asyncCond);
+  uv_mutex_destroy(&m_asyncLock);
+}
+
+int Database_Myfile::Init(CacheMode cacheMode)
+{
+  UnInit();
+
+  if (finishReshard(m_savedir, m_dbfile) < 0)
+    return -1;
+
+  int32_t shardCount = 0;
+  int32_t shardPolicy = MSP_XMOD;
+  if (!MyfilePartition::ReadShardConfig(MyfilePartition::GetDataPath(m_savedir, m_dbfile, 0) + "meta", shardCount, shardPolicy))
+  {
+    shardCount = m_shardCount > 0 ? m_shardCount : MYSQL_BLOCK_TABLE_NUM;
+    shardPolicy = m_shardPolicy >= 0 ? m_shardPolicy : MSP_XMOD;
+  }
+  else if ((m_shardCount > 0 && shardCount != m_shardCount) || (m_shardPolicy >= 0 && shardPolicy != m_shardPolicy))
+  {
+    LOG(ERROR) << "map " << m_dbfile << " keeps its " << shardCount << " partitions of policy " << shardPolicy
+      << ", reshard it to use " << m_shardCount << "/" << m_shardPolicy;
+  }
+
+  m_shardFunction = MyfileShardFunction::Create(shardPolicy, shardCount);
+  if (!m_shardFunction)
+  {
+    LOG(ERROR) << "invalid shard config: " << shardCount << "/" << shardPolicy;
+    return -1;
+  }
+  m_shardCount = shardCount;
+  m_shardPolicy = shardPolicy;
+
+  if (m_codec.Init(MyfilePartition::GetDataPath(m_savedir, m_dbfile, 0) + "dict") < 0)
+    return -1;
+
+  m_stmt.resize(m_shardCount);
+  for (int i = 0; i < m_shardCount; ++i)
+    m_stmt[i] = new MyfilePartition();
+  m_pendingWriteRequest.resize(m_shardCount);
+
+  for (int i = 0; i < m_shardCount; ++i)
+  {
+    if (m_stmt[i]->Init(m_savedir, m_dbfile, i, m_shardFunction, &m_codec, cacheMode) < 0)
+      return -1;
+    m_stmt[i]->SetDedup(m_dedup);
+    m_stmt[i]->SetLazyVerify(m_lazyVerify);
+    m_stmt[i]->SetDirectIO(m_directIO);
+    m_stmt[i]->SetMappedReads(m_mappedReads);
+  }
+
+  // writes logged before an unclean shutdown, applied in log order and flushed before the wal restarts
+  std::vector<MyfileWalRecord> records;
+  if (m_wal.Init(MyfilePartition::GetDataPath(m_savedir, m_dbfile, 0) + "wal", records) < 0)
+    return -1;
+  std::map<int64_t, size_t> lastRecords;
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    const MyfileWalRecord& record = records[i];
+    int16_t x, y, z;
+    Database::getIntegerAsBlock(record.pos, x, y, z);
+    MyfilePartition* partition = m_stmt[getTableIndex(x, y, z)];
+    // keys out of the local range and values too large to store were dropped when they were
+    // logged, the block keeps the value of its last stored record
+    bool stored = partition->getLocalIndex(x, y, z) >= 0;
+    bool ok = true;
+    if (stored && record.op == WO_DELETE)
+      ok = partition->deleteBlock(x, y, z);
+    else if (stored)
+      ok = partition->saveBlock(x, y, z, record.value, record.op == WO_SAVE_CHANGED, &stored);
+    if (!ok)
+    {
+      // Start would truncate the segments, the wal is kept for the next Init
+      LOG(ERROR) << "wal replay fail, index: " << record.pos << " map: " << m_dbfile;
+      return -1;
+    }
+    if (stored)
+      lastRecords[record.pos] = i;
+  }
+  if (!records.empty())
+  {
+    for (int i = 0; i < m_shardCount; ++i)
+      m_stmt[i]->flush();
+
+    // every replayed block must read back as its last record before the wal is dropped
+    for (auto it = lastRecords.begin(); it != lastRecords.end(); ++it)
+    {
+      const MyfileWalRecord& record = records[it->second];
+      int16_t x, y, z;
+      Database::getIntegerAsBlock(record.pos, x, y, z);
+      bool cacheHit = false;
+      std::string value = m_stmt[getTableIndex(x, y, z)]->loadBlock(x, y, z, cacheHit);
+      if (value != (record.op == WO_DELETE ? std::string() : record.value))
+      {
+        LOG(ERROR) << "wal replay check fail, index: " << record.pos << " map: " << m_dbfile;
+        return -1;
+      }
+    }
+    LOG(ERROR) << "wal replayed " << records.size() << " writes: " << m_dbfile;
+  }
+  if (m_wal.Start(m_walEnabled) < 0)
+    return -1;
+  for (int i = 0; i < m_shardCount; ++i)
+    m_stmt[i]->SetLogged(m_walEnabled);
+
+  m_wheelIndex = 0;
+
+  return 0;
+}
+
+int Database_Myfile::UnInit()
+{
+  StopAsync();
+  StopCompaction();
+  StopScrub();
+
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+  {
+    m_stmt[i]->UnInit();
+    delete m_stmt[i];
+  }
+  m_stmt.clear();
+  m_pendingWriteRequest.clear();
+  // the partitions are synced, nothing in the wal is needed anymore
+  m_wal.UnInit();
+  delete m_shardFunction;
+  m_shardFunction = nullptr;
+  m_codec.UnInit();
+
+  m_wheelIndex = 0;
+  return 0;
+}
+
+int Database_Myfile::getTableIndex(int16_t x, int16_t y, int16_t z)
+{
+  return m_shardFunction->getShard(x, y, z);
+}
+
+int Database_Myfile::finishReshard(const std::string &savedir, const std::string &dbfile)
+{
+  std::string stagefile = dbfile + ".reshard";
+  std::string marker = MyfilePartition::GetDataPath(savedir, stagefile, 0) + ".done";
+
+  if (!fs_system::PathExists(marker))
+  {
+    // an unfinished copy is thrown away
+    for (int i = 0; i < MAX_PARTITION_NUM; ++i)
+    {
+      std::string stagepath = MyfilePartition::GetDataPath(savedir, stagefile, i);
+      fs_system::DeleteSingleFile(stagepath);
+      fs_system::DeleteSingleFile(stagepath + "meta");
+    }
+    return 0;
+  }
+
+  // the copy is complete, the marker stays until every partition is in place
+  for (int i = 0; i < MAX_PARTITION_NUM; ++i)
+  {
+    std::string stagepath = MyfilePartition::GetDataPath(savedir, stagefile, i);
+    std::string path = MyfilePartition::GetDataPath(savedir, dbfile, i);
+    if (fs_system::PathExists(stagepath) && !fs_system::Rename(stagepath, path))
+      return -1;
+    if (fs_system::PathExists(stagepath + "meta") && !fs_system::Rename(stagepath + "meta", path + "meta"))
+      return -1;
+  }
+
+  int32_t shardCount = 0;
+  int32_t shardPolicy = MSP_XMOD;
+  if (!MyfilePartition::ReadShardConfig(MyfilePartition::GetDataPath(savedir, dbfile, 0) + "meta", shardCount, shardPolicy))
+    return -1;
+  for (int i = shardCount; i < MAX_PARTITION_NUM; ++i)
+  {
+    std::string path = MyfilePartition::GetDataPath(savedir, dbfile, i);
+    fs_system::DeleteSingleFile(path);
+    fs_system::DeleteSingleFile(path + "meta");
+  }
+
+  // the renames reach the disk before the marker goes, until then a power loss repeats them
+  if (!fs_system::SyncParentDir(MyfilePartition::GetDataPath(savedir, dbfile, 0)))
+    return -1;
+  fs_system::DeleteSingleFile(marker);
+  LOG(ERROR) << "reshard finished: " << dbfile << " partitions: " << shardCount;
+  return 0;
+}
+
+int Database_Myfile::Reshard(const std::string &savedir, const std::string &dbfile, int32_t shardCount, int32_t shardPolicy, int32_t codec, int threads)
+{
+  if (shardCount <= 0 || shardCount > MAX_PARTITION_NUM || shardPolicy < 0 || shardPolicy >= MSP_NUM)
+    return -1;
+  if (finishReshard(savedir, dbfile) < 0)
+    return -1;
+
+  Database_Myfile* src = new Database_Myfile(savedir, dbfile);
+  if (src->Init(CM_NOCACHE) < 0)
+  {
+    delete src;
+    return -1;
+  }
+  if (src->m_shardCount == shardCount && src->m_shardPolicy == shardPolicy && codec == MC_RAW)
+  {
+    delete src;
+    return 0;
+  }
+
+  Database_Myfile* dst = new Database_Myfile(savedir, dbfile + ".reshard");
+  dst->SetShardCount(shardCount);
+  dst->SetShardPolicy(shardPolicy);
+  // a deduplicated map stays deduplicated
+  int64_t sharedExtents = 0, sharedRefs = 0, dedupHits = 0;
+  src->GetDedupStats(sharedExtents, sharedRefs, dedupHits);
+  dst->SetDedup(sharedExtents > 0);
+  if (dst->Init(CM_APPEND) < 0)
+  {
+    delete src;
+    delete dst;
+    finishReshard(savedir, dbfile);
+    return -1;
+  }
+
+  // the dictionary file stays where it is, the new partitions compress against it
+  dst->m_codec.Init(MyfilePartition::GetDataPath(savedir, dbfile, 0) + "dict");
+  dst->SetCompression(codec, DEFAULT_CODEC_LEVEL);
 
-Database_Myfile::~Database_Myfile()
-{
-  UnInit();
-  uv_mutex_destroy(&m_cacheLock);
-  uv_mutex_destroy(&m_flushLock);
-}
+  LOG(ERROR) << "reshard " << dbfile << " from " << src->m_shardCount << "/" << src->m_shardPolicy
+    << " to " << shardCount << "/" << shardPolicy << " partitions/policy";
 
-int Database_Myfile::Init(CacheMode cacheMode)
-{
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
+  // each thread copies whole source partitions, the destination partitions lock themselves
+  std::atomic<int32_t> nextPartition(0);
+  std::atomic<bool> failed(false);
+  std::atomic<int64_t> copied(0);
+  auto copyPartitions = [&]()
   {
-    if (m_stmt[i].Init(m_savedir, m_dbfile, i, cacheMode) < 0)
-      return -1;
-  }
+    std::vector<int64_t> keys;
+    for (int32_t i = nextPartition++; i < src->m_shardCount && !failed; i = nextPartition++)
+    {
+      MyfilePartition* part = src->m_stmt[i];
+      // deleted blocks stay in the modify list until they are synced, so they are copied too
+      keys.clear();
+      part->listAllLoadableBlocks(keys);
+      part->GetModifyList(keys);
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      for (size_t k = 0; k < keys.size() && !failed; ++k)
+      {
+        int16_t x, y, z;
+        Database::getIntegerAsBlock(keys[k], x, y, z);
+        bool cacheHit = false;
+        std::string data = part->loadBlock(x, y, z, cacheHit);
+
+        uv_mutex_lock(&part->m_fileLock);
+        KeyNode* node = part->findNode(part->getLocalIndex(x, y, z));
+        bool exists = node && node->len != 0;
+        bool changed = node && node->flag[0] != 0;
+        uv_mutex_unlock(&part->m_fileLock);
+
+        MyfilePartition* target = dst->m_stmt[dst->getTableIndex(x, y, z)];
+        if (!exists)
+        {
+          uv_mutex_lock(&target->m_fileLock);
+          KeyNode* tombstone = target->getNode(target->getLocalIndex(x, y, z));
+          if (tombstone)
+          {
+            tombstone->flag[0] = 1;
+            target->markDirty(target->getLocalIndex(x, y, z));
+          }
+          target->m_metadataChanged = true;
+          uv_mutex_unlock(&target->m_fileLock);
+          if (!tombstone)
+            failed = true;
+          continue;
+        }
+
+        // an unreadable slot fails the reshard instead of storing the sentinel as the block
+        if (data == "ERROR")
+        {
+          LOG(ERROR) << "reshard read fail, index: " << keys[k];
+          failed = true;
+          continue;
+        }
+
+        if (!target->saveBlock(x, y, z, data, changed))
+        {
+          LOG(ERROR) << "reshard copy fail, index: " << keys[k];
+          failed = true;
+        }
+
+        // the copy is read back from the new partition, through its codec and dedup
+        bool targetHit = false;
+        if (!failed && target->loadBlock(x, y, z, targetHit) != data)
+        {
+          LOG(ERROR) << "reshard check fail, index: " << keys[k];
+          failed = true;
+        }
+        ++copied;
+      }
+    }
+  };
 
-  m_wheelIndex = 0;
+  std::vector<std::thread> workers;
+  for (int t = 1; t < threads; ++t)
+    workers.push_back(std::thread(copyPartitions));
+  copyPartitions();
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
 
-  return 0;
-}
+  int64_t sequence = 0;
+  for (int32_t i = 0; i < src->m_shardCount; ++i)
+  {
+    int64_t partSequence = src->m_stmt[i]->m_header->sequence;
+    sequence = std::max(sequence, partSequence);
+  }
+  for (int32_t i = 0; i < dst->m_shardCount; ++i)
+  {
+    dst->m_stmt[i]->m_header->sequence = sequence;
+    dst->m_stmt[i]->m_headerDirty = std::max(dst->m_stmt[i]->m_headerDirty, HEADER_FIELD_BYTES);
+  }
 
-int Database_Myfile::UnInit()
-{
+  delete src;
+  delete dst;
 
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
-    m_stmt[i].UnInit();
+  if (failed)
+  {
+    finishReshard(savedir, dbfile);
+    return -1;
+  }
 
-  m_wheelIndex = 0;
-  return 0;
-}
+  std::string marker = MyfilePartition::GetDataPath(savedir, dbfile + ".reshard", 0) + ".done";
+#ifdef WIN32
+  File* markerfile = new File(marker, GENERIC_WRITE | GENERIC_READ);
+#else
+  File* markerfile = new File(marker, O_RDWR);
+#endif
+  // the staged partitions were synced by UnInit, the directory sync also persists their entries
+  bool ok = markerfile->IsValid() && markerfile->Flush(false) && fs_system::SyncParentDir(marker);
+  delete markerfile;
+  if (!ok)
+  {
+    finishReshard(savedir, dbfile);
+    return -1;
+  }
 
-int Database_Myfile::getTableIndex(int64_t x)
-{
-  return abs(x % MYSQL_BLOCK_TABLE_NUM);
+  LOG(ERROR) << "reshard copied " << copied << " blocks: " << dbfile;
+  return finishReshard(savedir, dbfile);
 }
 
 bool Database_Myfile::checkflush()
@@ -705,7 +3404,7 @@ bool Database_Myfile::checkflush()
 
   uv_mutex_lock(&m_flushLock);
   bool bFlushed = true;
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
+  for (size_t i = 0; i < m_pendingWriteRequest.size(); ++i)
     bFlushed &= (m_pendingWriteRequest[i].empty());
   uv_mutex_unlock(&m_flushLock);
 
@@ -736,28 +3435,96 @@ bool Database_Myfile::__directSaveBlock(int64_t pos, const std::string &data, bo
 {
   int16_t x, y, z;
   Database::getIntegerAsBlock(pos, x, y, z);
-  int index = getTableIndex(x);
-  m_stmt[index].saveBlock(x, y, z, data, changed);
+  int index = getTableIndex(x, y, z);
+  if (!m_wal.IsLogging())
+    return m_stmt[index]->saveBlock(x, y, z, data, changed);
 
-  return true;
+  // a value the partitions can not store is never logged, its replay would not read back
+  if (data.length() > MAX_DATA_LENGTH)
+  {
+    LOG(ERROR) << "saveBlock data too large: " << data.length() << " index: " << pos;
+    return false;
+  }
+
+  // applied under the shared lock, so a checkpoint never flushes the partitions between the two.
+  // a write the wal could not make durable is not applied
+  uv_rwlock_rdlock(&m_walLock);
+  bool ok = m_wal.Append(changed ? WO_SAVE_CHANGED : WO_SAVE, pos, data.c_str(), data.length());
+  if (ok)
+    ok = m_stmt[index]->saveBlock(x, y, z, data, changed);
+  else
+    LOG(ERROR) << "wal append fail, save rejected: " << pos;
+  uv_rwlock_rdunlock(&m_walLock);
+
+  return ok;
+}
+
+bool Database_Myfile::__directSaveBlocks(const std::vector<std::pair<int64_t, std::string>>& blocks, bool changed)
+{
+  std::vector<std::vector<const std::pair<int64_t, std::string>*>> partitions(m_stmt.size());
+  for (size_t i = 0; i < blocks.size(); ++i)
+  {
+    int16_t x, y, z;
+    Database::getIntegerAsBlock(blocks[i].first, x, y, z);
+    partitions[getTableIndex(x, y, z)].push_back(&blocks[i]);
+  }
+
+  bool logging = m_wal.IsLogging();
+  for (size_t i = 0; logging && i < blocks.size(); ++i)
+  {
+    if (blocks[i].second.length() > MAX_DATA_LENGTH)
+    {
+      LOG(ERROR) << "saveBlocks data too large: " << blocks[i].second.length() << " index: " << blocks[i].first;
+      return false;
+    }
+  }
+  if (logging)
+  {
+    uv_rwlock_rdlock(&m_walLock);
+    if (!m_wal.Append(changed ? WO_SAVE_CHANGED : WO_SAVE, blocks))
+    {
+      uv_rwlock_rdunlock(&m_walLock);
+      LOG(ERROR) << "wal append fail, save rejected: " << blocks.size() << " blocks";
+      return false;
+    }
+  }
+  bool ok = true;
+  for (size_t i = 0; i < partitions.size(); ++i)
+  {
+    if (!partitions[i].empty())
+      ok &= m_stmt[i]->saveBlocks(partitions[i], changed);
+  }
+  if (logging)
+    uv_rwlock_rdunlock(&m_walLock);
+
+  return ok;
 }
 
 bool Database_Myfile::__directDeleteBlock(int64_t pos)
 {
   int16_t x, y, z;
   Database::getIntegerAsBlock(pos, x, y, z);
-  int index = getTableIndex(x);
-  m_stmt[index].deleteBlock(x, y, z);
+  int index = getTableIndex(x, y, z);
+  if (!m_wal.IsLogging())
+    return m_stmt[index]->deleteBlock(x, y, z);
+
+  uv_rwlock_rdlock(&m_walLock);
+  bool ok = m_wal.Append(WO_DELETE, pos, nullptr, 0);
+  if (ok)
+    ok = m_stmt[index]->deleteBlock(x, y, z);
+  else
+    LOG(ERROR) << "wal append fail, delete rejected: " << pos;
+  uv_rwlock_rdunlock(&m_walLock);
 
-  return true;
+  return ok;
 }
 
 std::string Database_Myfile::__directLoadBlock(int64_t pos, bool& changed)
 {
   int16_t x, y, z;
   Database::getIntegerAsBlock(pos, x, y, z);
-  int index = getTableIndex(x);
-  return m_stmt[index].loadBlock(x, y, z, changed);
+  int index = getTableIndex(x, y, z);
+  return m_stmt[index]->loadBlock(x, y, z, changed);
 }
 
 bool Database_Myfile::forceflush()
@@ -782,8 +3549,14 @@ bool Database_Myfile::forceflush()
   if (try_count == max_try_count)
     LOG(ERROR) << "forceflush while m_modifyCommands not clean! count: " << copyCommands.size();
 
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM;  ++i)
-    m_stmt[i].flush();
+  // checkpoint: writes logged to the old segment are all applied once the rotation gets the lock
+  uv_rwlock_wrlock(&m_walLock);
+  int32_t segment = m_wal.Rotate();
+  uv_rwlock_wrunlock(&m_walLock);
+
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->flush();
+  m_wal.Release(segment);
 
   return true;
 }
@@ -791,20 +3564,223 @@ bool Database_Myfile::forceflush()
 void Database_Myfile::GetCacheSummary(int32_t& cacheCount, int32_t& cacheMemoryBytes)
 {
   cacheCount = cacheMemoryBytes = 0;
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
+  for (size_t i = 0; i < m_stmt.size(); ++i)
   {
     int32_t subCacheCount = 0;
     int32_t subCacheMemoryBytes = 0;
-    m_stmt[i].GetCacheSummary(subCacheCount, subCacheMemoryBytes);
+    m_stmt[i]->GetCacheSummary(subCacheCount, subCacheMemoryBytes);
     cacheCount += subCacheCount;
     cacheMemoryBytes += subCacheMemoryBytes;
   }
 }
 
+int Database_Myfile::TrainDictionary(int32_t sampleCount, int32_t maxBytes)
+{
+  std::vector<int64_t> keys;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->listAllLoadableBlocks(keys);
+  if (keys.empty() || sampleCount <= 0)
+    return -1;
+
+  // evenly spread over the map, the partitions lock themselves
+  std::vector<std::string> samples;
+  size_t step = std::max<size_t>(1, keys.size() / sampleCount);
+  for (size_t k = 0; k < keys.size() && (int32_t)samples.size() < sampleCount; k += step)
+  {
+    bool changed = false;
+    std::string data = __directLoadBlock(keys[k], changed);
+    if (!data.empty())
+      samples.push_back(data);
+  }
+  return m_codec.TrainDictionary(samples, maxBytes);
+}
+
+void Database_Myfile::SetDedup(bool dedup)
+{
+  m_dedup = dedup;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->SetDedup(dedup);
+}
+
+void Database_Myfile::SetLazyVerify(bool lazy)
+{
+  m_lazyVerify = lazy;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->SetLazyVerify(lazy);
+}
+
+void Database_Myfile::SetDirectIO(bool direct)
+{
+  m_directIO = direct;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->SetDirectIO(direct);
+}
+
+void Database_Myfile::SetMappedReads(bool mapped)
+{
+  m_mappedReads = mapped;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->SetMappedReads(mapped);
+}
+
+void Database_Myfile::GetDedupStats(int64_t& extents, int64_t& refs, int64_t& hits)
+{
+  extents = 0;
+  refs = 0;
+  hits = 0;
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+  {
+    int64_t partExtents = 0, partRefs = 0, partHits = 0;
+    m_stmt[i]->GetDedupSummary(partExtents, partRefs, partHits);
+    extents += partExtents;
+    refs += partRefs;
+    hits += partHits;
+  }
+}
+
+void Database_Myfile::GetShardStats(std::vector<MyfileShardStats>& stats)
+{
+  stats.resize(m_stmt.size());
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->GetShardStats(stats[i]);
+}
+
+bool Database_Myfile::StartCompaction(float minAmplification)
+{
+  if (m_compactThread.joinable())
+  {
+    if (IsCompacting())
+      return false;
+    m_compactThread.join();
+  }
+
+  m_compactStop = false;
+  m_compactPartition = 0;
+  m_compactThread = std::thread(&Database_Myfile::compactThread, this, minAmplification);
+  return true;
+}
+
+void Database_Myfile::StopCompaction()
+{
+  m_compactStop = true;
+  if (m_compactThread.joinable())
+    m_compactThread.join();
+  m_compactPartition = -1;
+}
+
+void Database_Myfile::compactThread(float minAmplification)
+{
+  for (int i = 0; i < (int)m_stmt.size() && !m_compactStop; ++i)
+  {
+    int64_t liveBytes = 0;
+    int64_t fileBytes = 0;
+    int64_t freeBytes = 0;
+    m_stmt[i]->GetSpaceSummary(liveBytes, fileBytes, freeBytes);
+    if (fileBytes <= 0 || fileBytes < liveBytes * minAmplification)
+      continue;
+
+    m_compactPartition = i;
+    if (m_stmt[i]->Compact(&m_compactStop) < 0)
+    {
+      LOG(ERROR) << "compact partition fail: " << i;
+      continue;
+    }
+
+    int64_t compactedBytes = 0;
+    m_stmt[i]->GetSpaceSummary(liveBytes, compactedBytes, freeBytes);
+    m_compactReclaimedBytes += fileBytes - compactedBytes;
+    ++m_compactedPartitions;
+  }
+  m_compactPartition = -1;
+}
+
+bool Database_Myfile::StartScrub(int64_t bytesPerSecond, int32_t intervalSeconds)
+{
+  if (m_scrubThread.joinable())
+  {
+    if (IsScrubbing())
+      return false;
+    m_scrubThread.join();
+  }
+
+  m_scrubStop = false;
+  m_scrubRunning = true;
+  m_scrubThread = std::thread(&Database_Myfile::scrubThread, this, bytesPerSecond, intervalSeconds);
+  return true;
+}
+
+void Database_Myfile::StopScrub()
+{
+  m_scrubStop = true;
+  if (m_scrubThread.joinable())
+    m_scrubThread.join();
+  m_scrubPartition = -1;
+}
+
+void Database_Myfile::scrubThread(int64_t bytesPerSecond, int32_t intervalSeconds)
+{
+  while (!m_scrubStop)
+  {
+    for (int i = 0; i < (int)m_stmt.size() && !m_scrubStop; ++i)
+    {
+      m_scrubPartition = i;
+      if (m_stmt[i]->Scrub(&m_scrubStop, bytesPerSecond, m_scrubCallback) < 0)
+        LOG(ERROR) << "scrub partition fail: " << i;
+    }
+    m_scrubPartition = -1;
+    if (m_scrubStop)
+      break;
+    ++m_scrubPasses;
+
+    if (intervalSeconds <= 0)
+      break;
+    for (int64_t t = 0; t < intervalSeconds * 10LL && !m_scrubStop; ++t)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  m_scrubRunning = false;
+}
+
+void Database_Myfile::GetScrubStats(MyfileScrubStats& stats)
+{
+  memset(&stats, 0, sizeof(stats));
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+  {
+    int64_t slots = 0, bytes = 0, bad = 0;
+    m_stmt[i]->GetScrubSummary(slots, bytes, bad);
+    stats.scannedSlots += slots;
+    stats.scannedBytes += bytes;
+    stats.badSlots += bad;
+  }
+  stats.passes = m_scrubPasses;
+  stats.runningPartition = m_scrubPartition;
+}
+
+void Database_Myfile::GetCompactionStats(MyfileCompactionStats& stats)
+{
+  memset(&stats, 0, sizeof(stats));
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+  {
+    int64_t liveBytes = 0;
+    int64_t fileBytes = 0;
+    int64_t freeBytes = 0;
+    m_stmt[i]->GetSpaceSummary(liveBytes, fileBytes, freeBytes);
+    stats.liveBytes += liveBytes;
+    stats.fileBytes += fileBytes;
+    stats.freeBytes += freeBytes;
+  }
+  stats.spaceAmplification = stats.liveBytes > 0 ? (float)stats.fileBytes / stats.liveBytes : 1.f;
+
+  stats.runningPartition = m_compactPartition;
+  if (stats.runningPartition >= 0)
+    m_stmt[stats.runningPartition]->GetCompactProgress(stats.copiedNodes, stats.totalNodes);
+  stats.compactedPartitions = m_compactedPartitions;
+  stats.reclaimedBytes = m_compactReclaimedBytes;
+}
+
 bool Database_Myfile::GetModifyList(std::vector<int64_t>& v)
 {
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
-    m_stmt[i].GetModifyList(v);
+  for (size_t i = 0; i < m_stmt.size(); ++i)
+    m_stmt[i]->GetModifyList(v);
 
   return true;
 }
@@ -824,6 +3800,9 @@ int Database_Myfile::PrintHitRate()
   int32_t cacheMemoryBytes = 0;
   GetCacheSummary(cacheCount, cacheMemoryBytes);
 
+  MyfileCompactionStats compactStats;
+  GetCompactionStats(compactStats);
+
   time_t tt = time(NULL);
   tm* t = localtime(&tt);
   char buffer[64] = { 0 };
@@ -842,6 +3821,42 @@ int Database_Myfile::PrintHitRate()
   std::cout << "m_cache2HitCount: " << m_cache2HitCount << std::endl;
   std::cout << "hitRatio: " << hitRatio << "%" << std::endl;
   std::cout << "cacheCount: " << cacheCount << " cacheMemory: " << cacheMemoryBytes / 1024 / 1024 << "M" << std::endl;
+  std::cout << "liveData: " << compactStats.liveBytes / 1024 / 1024 << "M" << " fileData: " << compactStats.fileBytes / 1024 / 1024 << "M"
+    << " freeSlots: " << compactStats.freeBytes / 1024 / 1024 << "M"
+    << " spaceAmplification: " << compactStats.spaceAmplification << " compacting: " << compactStats.runningPartition << std::endl;
+
+  int64_t dedupExtents = 0, dedupRefs = 0, dedupHits = 0;
+  GetDedupStats(dedupExtents, dedupRefs, dedupHits);
+  if (dedupExtents > 0)
+    std::cout << "dedup sharedSlots: " << dedupExtents << " sharedBlocks: " << dedupRefs << " hits: " << dedupHits << std::endl;
+
+  MyfileWalStats walStats;
+  m_wal.GetStats(walStats);
+  if (walStats.records > 0)
+    std::cout << "wal records: " << walStats.records << " commits: " << walStats.commits << " bytes: " << walStats.bytes
+      << " checkpoints: " << walStats.checkpoints << std::endl;
+
+  MyfileScrubStats scrubStats;
+  GetScrubStats(scrubStats);
+  if (scrubStats.scannedSlots > 0)
+    std::cout << "scrub passes: " << scrubStats.passes << " slots: " << scrubStats.scannedSlots << " bytes: " << scrubStats.scannedBytes / 1024 / 1024 << "M"
+      << " bad: " << scrubStats.badSlots << " running: " << scrubStats.runningPartition << std::endl;
+
+  // max / mean of the operations per shard, 1 is a perfect spread
+  std::vector<MyfileShardStats> shardStats;
+  GetShardStats(shardStats);
+  int64_t totalOps = 0;
+  int64_t maxOps = 0;
+  for (size_t i = 0; i < shardStats.size(); ++i)
+  {
+    int64_t ops = shardStats[i].reads + shardStats[i].writes;
+    totalOps += ops;
+    maxOps = std::max(maxOps, ops);
+    std::cout << "shard " << i << " reads: " << shardStats[i].reads << " writes: " << shardStats[i].writes
+      << " misses: " << shardStats[i].misses << " lockWaits: " << shardStats[i].lockWaits << std::endl;
+  }
+  float imbalance = totalOps > 0 ? (float)maxOps * shardStats.size() / totalOps : 1.f;
+  std::cout << "shards: " << m_shardCount << " policy: " << m_shardPolicy << " imbalance: " << imbalance << std::endl;
   std::cout << "------------------------------------------------------------" << std::endl;
   
   m_tpsCounterR = 0;
@@ -878,21 +3893,327 @@ std::string Database_Myfile::loadBlock(int64_t pos)
 
   int16_t x, y, z;
   Database::getIntegerAsBlock(pos, x, y, z);
-  int index = getTableIndex(x);
+  int index = getTableIndex(x, y, z);
 
-  ret = m_stmt[index].loadBlock(x, y, z, cacheHit);
+  ret = m_stmt[index]->loadBlock(x, y, z, cacheHit);
   if (cacheHit)
     ++m_cache2HitCount;
 
   return ret;
 }
 
+BlockRef Database_Myfile::loadBlockRef(const v3s16 &pos)
+{
+  int64_t key = getBlockAsInteger(pos);
+  ++m_tpsCounterR;
+  ++m_totalLoadCount;
+  if (!m_valueCache.empty())
+  {
+    BlockRef ref;
+    uv_mutex_lock(&m_cacheLock);
+    auto it = m_valueCache.find(key);
+    bool found = it != m_valueCache.end();
+    if (found && !it->second.empty())
+      ref = BlockRef(BlockBuffer::Create(it->second.c_str(), it->second.length()));
+    uv_mutex_unlock(&m_cacheLock);
+    if (found)
+    {
+      ++m_cache1HitCount;
+      return ref;
+    }
+  }
+
+  int16_t x, y, z;
+  Database::getIntegerAsBlock(key, x, y, z);
+  bool cacheHit = false;
+  BlockRef ref = m_stmt[getTableIndex(x, y, z)]->loadBlockRef(x, y, z, cacheHit);
+  if (cacheHit)
+    ++m_cache2HitCount;
+  return ref;
+}
+
+void Database_Myfile::loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> &values)
+{
+  std::vector<int64_t> keys(pos.size());
+  for (size_t i = 0; i < pos.size(); ++i)
+    keys[i] = getBlockAsInteger(pos[i]);
+  loadBlocks(keys, values);
+}
+
+void Database_Myfile::loadBlocks(const std::vector<int64_t> &pos, std::vector<std::string> &values)
+{
+  m_tpsCounterR += pos.size();
+  m_totalLoadCount += pos.size();
+  values.assign(pos.size(), std::string());
+  std::vector<char> found(pos.size(), 0);
+  if (!m_valueCache.empty())
+  {
+    uv_mutex_lock(&m_cacheLock);
+    for (size_t i = 0; i < pos.size(); ++i)
+    {
+      auto it = m_valueCache.find(pos[i]);
+      if (it == m_valueCache.end())
+        continue;
+      values[i] = it->second;
+      found[i] = 1;
+      ++m_cache1HitCount;
+    }
+    uv_mutex_unlock(&m_cacheLock);
+  }
+
+  std::vector<std::vector<std::pair<int64_t, std::string*>>> partitions(m_stmt.size());
+  for (size_t i = 0; i < pos.size(); ++i)
+  {
+    if (found[i])
+      continue;
+    int16_t x, y, z;
+    Database::getIntegerAsBlock(pos[i], x, y, z);
+    partitions[getTableIndex(x, y, z)].push_back(std::make_pair(pos[i], &values[i]));
+  }
+
+  // the partitions have their own locks and files. a large batch hands the shares after the first
+  // to the async threads when they run, a small one or a batch of one partition is read here
+  std::atomic<int64_t> hits(0);
+  int32_t remaining = 0;
+  int32_t own = -1;
+  size_t count = 0;
+  for (size_t i = 0; i < partitions.size(); ++i)
+    count += partitions[i].size();
+  uv_mutex_lock(&m_asyncLock);
+  bool pooled = !m_asyncStop && count >= LOAD_BLOCKS_POOLED_MIN;
+  for (size_t i = 0; pooled && i < partitions.size(); ++i)
+  {
+    if (partitions[i].empty())
+      continue;
+    if (own < 0)
+    {
+      own = i;
+      continue;
+    }
+    MyfileAsyncRequest* request = new MyfileAsyncRequest();
+    request->pos = i;
+    request->save = false;
+    request->ok = false;
+    request->callback = nullptr;
+    request->blocks = &partitions[i];
+    request->remaining = &remaining;
+    request->hits = &hits;
+    m_asyncQueues[i % m_asyncQueues.size()].push_back(request);
+    ++remaining;
+  }
+  if (remaining > 0)
+    uv_cond_broadcast(&m_asyncCond);
+  uv_mutex_unlock(&m_asyncLock);
+
+  for (size_t i = 0; i < partitions.size(); ++i)
+  {
+    if (!partitions[i].empty() && (!pooled || (int32_t)i == own))
+      hits += m_stmt[i]->loadBlocks(partitions[i]);
+  }
+
+  uv_mutex_lock(&m_asyncLock);
+  while (remaining > 0)
+    uv_cond_wait(&m_asyncShares, &m_asyncLock);
+  uv_mutex_unlock(&m_asyncLock);
+  m_cache2HitCount += hits;
+}
+
+bool Database_Myfile::StartAsync(uv_loop_t* loop, int threads)
+{
+  if (m_asyncDone || threads <= 0 || m_stmt.empty())
+    return false;
+
+  m_asyncDone = new uv_async_t;
+  if (uv_async_init(loop, m_asyncDone, &Database_Myfile::onAsyncDone) != 0)
+  {
+    LOG(ERROR) << "uv_async_init fail: " << m_dbfile;
+    delete m_asyncDone;
+    m_asyncDone = nullptr;
+    return false;
+  }
+  m_asyncDone->data = this;
+
+  // loadBlocks hands its shares to the threads once m_asyncStop is cleared
+  m_asyncQueues.resize(threads);
+  uv_mutex_lock(&m_asyncLock);
+  m_asyncStop = false;
+  uv_mutex_unlock(&m_asyncLock);
+  for (int i = 0; i < threads; ++i)
+    m_asyncThreads.push_back(std::thread(&Database_Myfile::asyncThread, this, i));
+  return true;
+}
+
+void Database_Myfile::StopAsync()
+{
+  if (!m_asyncDone)
+    return;
+
+  uv_mutex_lock(&m_asyncLock);
+  m_asyncStop = true;
+  uv_cond_broadcast(&m_asyncCond);
+  uv_mutex_unlock(&m_asyncLock);
+  for (size_t i = 0; i < m_asyncThreads.size(); ++i)
+    m_asyncThreads[i].join();
+  m_asyncThreads.clear();
+  m_asyncQueues.clear();
+
+  completeAsync();
+  // the loop frees the handle once it is closed
+  uv_close((uv_handle_t*)m_asyncDone, [](uv_handle_t* handle) { delete (uv_async_t*)handle; });
+  m_asyncDone = nullptr;
+}
+
+void Database_Myfile::onAsyncDone(uv_async_t* handle)
+{
+  ((Database_Myfile*)handle->data)->completeAsync();
+}
+
+void Database_Myfile::completeAsync()
+{
+  std::list<MyfileAsyncRequest*> completed;
+  uv_mutex_lock(&m_asyncLock);
+  completed.swap(m_asyncCompleted);
+  uv_mutex_unlock(&m_asyncLock);
+
+  for (auto it = completed.begin(); it != completed.end(); ++it)
+  {
+    MyfileAsyncRequest* request = *it;
+    if (request->save)
+      request->callback->OnBlockSaved(request->pos, request->ok);
+    else
+      request->callback->OnBlockLoaded(request->pos, request->data);
+    delete request;
+  }
+}
+
+void Database_Myfile::asyncThread(int32_t worker)
+{
+  std::list<MyfileAsyncRequest*>& queue = m_asyncQueues[worker];
+  uv_mutex_lock(&m_asyncLock);
+  while (!queue.empty() || !m_asyncStop)
+  {
+    if (queue.empty())
+    {
+      uv_cond_wait(&m_asyncCond, &m_asyncLock);
+      continue;
+    }
+    MyfileAsyncRequest* request = queue.front();
+    queue.pop_front();
+    uv_mutex_unlock(&m_asyncLock);
+
+    if (request->blocks)
+    {
+      *request->hits += m_stmt[request->pos]->loadBlocks(*request->blocks);
+      uv_mutex_lock(&m_asyncLock);
+      if (--*request->remaining == 0)
+        uv_cond_broadcast(&m_asyncShares);
+      delete request;
+      continue;
+    }
+
+    // the result of the wal append and of the partition write, reported by OnBlockSaved
+    if (request->save)
+      request->ok = __directSaveBlock(request->pos, request->data, false);
+    else
+      request->data = loadBlock(request->pos);
+
+    uv_mutex_lock(&m_asyncLock);
+    if (request->save)
+    {
+      auto it = m_asyncSaves.find(request->pos);
+      if (--it->second == 0)
+        m_asyncSaves.erase(it);
+    }
+    m_asyncCompleted.push_back(request);
+    uv_async_send(m_asyncDone);
+  }
+  uv_mutex_unlock(&m_asyncLock);
+}
+
+bool Database_Myfile::loadCachedBlock(int64_t pos, std::string& value)
+{
+  if (!m_valueCache.empty())
+  {
+    uv_mutex_lock(&m_cacheLock);
+    auto it = m_valueCache.find(pos);
+    bool found = it != m_valueCache.end();
+    if (found)
+      value = it->second;
+    uv_mutex_unlock(&m_cacheLock);
+    if (found)
+    {
+      ++m_cache1HitCount;
+      return true;
+    }
+  }
+
+  int16_t x, y, z;
+  Database::getIntegerAsBlock(pos, x, y, z);
+  if (!m_stmt[getTableIndex(x, y, z)]->loadCachedBlock(x, y, z, value))
+    return false;
+  ++m_cache2HitCount;
+  return true;
+}
+
+bool Database_Myfile::loadBlockAsync(const v3s16 &pos, MyFileAsyncCallback* callback)
+{
+  if (!m_asyncDone)
+    return false;
+
+  int64_t key = getBlockAsInteger(pos);
+  uv_mutex_lock(&m_asyncLock);
+  bool saving = m_asyncSaves.find(key) != m_asyncSaves.end();
+  uv_mutex_unlock(&m_asyncLock);
+
+  // a queued save of the block is not in the cache yet, the load waits behind it
+  std::string value;
+  if (!saving && loadCachedBlock(key, value))
+  {
+    ++m_tpsCounterR;
+    ++m_totalLoadCount;
+    callback->OnBlockLoaded(key, value);
+    return true;
+  }
+
+  MyfileAsyncRequest* request = new MyfileAsyncRequest();
+  request->pos = key;
+  request->save = false;
+  request->ok = false;
+  request->callback = callback;
+  request->blocks = nullptr;
+  uv_mutex_lock(&m_asyncLock);
+  m_asyncQueues[(uint64_t)key % m_asyncQueues.size()].push_back(request);
+  uv_cond_broadcast(&m_asyncCond);
+  uv_mutex_unlock(&m_asyncLock);
+  return true;
+}
+
+bool Database_Myfile::saveBlockAsync(const v3s16 &pos, const std::string &data, MyFileAsyncCallback* callback)
+{
+  if (!m_asyncDone)
+    return false;
+
+  MyfileAsyncRequest* request = new MyfileAsyncRequest();
+  request->pos = getBlockAsInteger(pos);
+  request->save = true;
+  request->ok = false;
+  request->data = data;
+  request->callback = callback;
+  request->blocks = nullptr;
+  uv_mutex_lock(&m_asyncLock);
+  ++m_asyncSaves[request->pos];
+  m_asyncQueues[(uint64_t)request->pos % m_asyncQueues.size()].push_back(request);
+  uv_cond_broadcast(&m_asyncCond);
+  uv_mutex_unlock(&m_asyncLock);
+  return true;
+}
+
 bool Database_Myfile::listAllLoadableBlocks(std::vector<int64_t> &dst)
 {
-  for (int i = 0; i < MYSQL_BLOCK_TABLE_NUM; ++i)
+  for (size_t i = 0; i < m_stmt.size(); ++i)
   {
     std::vector<int64_t> dst_child;
-    if (!m_stmt[i].listAllLoadableBlocks(dst_child))
+    if (!m_stmt[i]->listAllLoadableBlocks(dst_child))
       return false;
     std::copy(dst_child.begin(), dst_child.end(), std::back_inserter(dst));
   }
@@ -922,6 +4243,35 @@ bool Database_Myfile::saveBlock(int64_t pos, const std::string &data)
   return __directSaveBlock(pos, data, true);
 }
 
+bool Database_Myfile::saveBlockRef(const v3s16 &pos, const BlockRef &data)
+{
+  int64_t key = Database::getBlockAsInteger(pos);
+  int index = getTableIndex(pos.X, pos.Y, pos.Z);
+  if (!m_wal.IsLogging())
+    return m_stmt[index]->saveBlockRef(pos.X, pos.Y, pos.Z, data, false);
+
+  if (data.size() > MAX_DATA_LENGTH)
+  {
+    LOG(ERROR) << "saveBlockRef data too large: " << data.size() << " index: " << key;
+    return false;
+  }
+
+  uv_rwlock_rdlock(&m_walLock);
+  bool ok = m_wal.Append(WO_SAVE, key, data.data(), data.size());
+  if (ok)
+    ok = m_stmt[index]->saveBlockRef(pos.X, pos.Y, pos.Z, data, false);
+  else
+    LOG(ERROR) << "wal append fail, save rejected: " << key;
+  uv_rwlock_rdunlock(&m_walLock);
+
+  return ok;
+}
+
+bool Database_Myfile::saveBlocks(const std::vector<std::pair<int64_t, std::string>>& blocks)
+{
+  return __directSaveBlocks(blocks, false);
+}
+
 bool Database_Myfile::deleteBlock(const v3s16 &pos) {
     return deleteBlock(getBlockAsInteger(pos));
 }
@@ -9,36 +9,117 @@
 #include <vector>
 #include <memory>
 #include <list>
+#include <set>
+#include <unordered_map>
 #include "util/file_system.h"
+#include "util/buffer_pool.h"
+#include "util/epoch.h"
+#include "util/frequency_sketch.h"
+#include "database-myfile-codec.h"
+#include "database-myfile-wal.h"
 #include <atomic>
+#include <thread>
+#include <cstddef>
 
-#define MYSQL_BLOCK_TABLE_NUM 10
+#define MYSQL_BLOCK_TABLE_NUM 10  // default shard count, and the one of every map written before it was stored
+#define MAX_PARTITION_NUM 256
 
-#define MAX_NODE 14 * 104 * 1024 // 1M, each map need 160M(x64 build)
-#define MAX_CACHE MAX_NODE / 56
+#define LEGACY_MAX_NODE 14 * 104 * 1024 // 1M, the fixed KeyNode array of version 1 meta files
+#define MAX_CACHE LEGACY_MAX_NODE / 56
 #define MAX_CACHE_LENGTH 20 * 1024 * 1024  // each map need 200M
+#define MAX_CACHE_SPARED 64  // values hit without the lock one eviction keeps before it evicts them anyway
+#define CACHE_WINDOW_PERCENT    1   // share of the cached values new values wait in before they compete for the rest
+#define CACHE_PROTECTED_PERCENT 80  // share of the rest kept for values hit again while on probation
 #define MAX_DATA_LENGTH    65535
+#define MAX_WRITE_RUN_BYTES (16 * 1024 * 1024)  // largest single vectored write of saveBlocks
+#define MAX_READ_RUN_BYTES (1024 * 1024)        // largest single read of loadBlocks
+#define MAX_READ_GAP_BYTES (32 * 1024)          // unrequested bytes loadBlocks reads to join two slots
+#define MAX_READ_CHUNK_BYTES (4 * MAX_READ_RUN_BYTES)  // runs loadBlocks reads per release of the partition lock
+#define LOAD_BLOCKS_POOLED_MIN 64               // blocks of a loadBlocks call before its partitions are read on the async threads
+#define IO_RING_ENTRIES 64                      // reads of loadBlocks in flight per partition
+#define IO_RING_BUFFER_BYTES (2 * 1024 * 1024)  // registered read buffer per partition
+#define DIRECT_IO_ALIGN 4096                    // offset and length granularity of O_DIRECT reads
+#define DATA_MAP_RESERVE_BYTES (256 * 1024 * 1024)  // mapped past the end of the data file, appends within it need no remap
+#define FREE_SLOT_CLASS_NUM (MAX_DATA_LENGTH / 1024 + 2)  // 1K classes, the last one holds the coalesced large holes
+
+#define MYFILE_VERSION_LEGACY 1  // fixed KeyNode array, x in [0, 640), y in [-14, 9), z in [0, 1024)
+#define MYFILE_VERSION_SPARSE 2  // KeyNode pages allocated on demand, brick linear keys
+#define MYFILE_VERSION_MORTON 3  // Morton ordered keys
+#define MYFILE_VERSION_INLINE 4  // wide KeyNodes holding tiny values
+
+// The sparse index covers 12 bits per axis. The key interleaves the bits of z, x and y, so
+// neighbours in all three axes sit close in key order, and splits into a 24 bit page number
+// and a 12 bit slot, each index page holds the KeyNodes of one 16x16x16 brick. Pages are
+// found through a two level directory of 4096 * 4096 entries.
+#define INDEX_PAGE_BITS  12
+#define INDEX_PAGE_NODES (1 << INDEX_PAGE_BITS)
+#define INDEX_DIR_BITS   12
+#define INDEX_DIR_SIZE   (1 << INDEX_DIR_BITS)
+#define MAX_INDEX_PAGE   16000  // 64M nodes per partition
+
+// NodeHeader.index of a slot shared by identical values
+#define SHARED_NODE_INDEX 0xFFFFFFFF
+#define INLINE_VALUE_LENGTH 48  // stored values up to this length live in the KeyNode
+
+// KeyNode.flag[1], where the value of a node is stored
+enum KeyNodeKind
+{
+  KNK_SLOT = 0,  // a slot of the data file owned by the node
+  KNK_SHARED,    // a slot shared by the nodes of identical values
+  KNK_INLINE,    // KeyNode.value, no slot
+};
 
 #pragma pack(1)
 
-struct KeyNode
+// index entry of version 1 to 3 files
+struct KeyNodeV3
 {
 private:
   int32_t pos;
 public:
-  int16_t capacity;
-  int16_t len;
+  uint16_t capacity;
+  uint16_t len;
   char    flag[2];
-  int64_t getPos() const { return pos * 1024;  }
+  int64_t getPos() const { return (int64_t)pos * 1024;  }
+};
+
+struct KeyNode
+{
+private:
+  int32_t pos;
+public:
+  uint16_t capacity;
+  uint16_t len;
+  char    flag[2];  // modified, KeyNodeKind
+  uint8_t  codec;   // codec, dictionary and crc of an inline value
+  uint8_t  dict;
+  uint32_t crc;
+  char     value[INLINE_VALUE_LENGTH];
+  int64_t getPos() const { return (int64_t)pos * 1024;  }
   void setPos(int64_t pos_) { assert(pos_ % 1024 == 0);  pos = pos_ / 1024; }
 };
 
+struct MyfileHeaderV1
+{
+  int16_t version;
+  int64_t sequence;
+  int32_t count;
+  KeyNodeV3 node[LEGACY_MAX_NODE]; //18M
+  int32_t compacting;
+};
+
 struct MyfileHeader
 {
   int16_t version;
   int64_t sequence;
   int32_t count;
-  KeyNode node[MAX_NODE]; //18M
+  int32_t compacting;  // 1 while a compacted data file is being swapped in
+  int32_t pageCount;
+  int32_t shardCount;  // partitions of the map, 0 in files written before it was stored
+  int32_t shardPolicy; // MyfileShardPolicy
+  int32_t checksum;    // ChecksumType of the slots and inline values, CT_CRC32 in files written before it
+  int32_t reserved[61];
+  int32_t page[MAX_INDEX_PAGE];  // page number of each index page stored behind the header
 };
 
 struct NodeHeader
@@ -47,22 +128,131 @@ struct NodeHeader
   uint32_t crc;
   uint32_t index;
   uint64_t timestamp;
-  uint32_t reserved;
+  uint8_t  codec;     // MyfileCodec of the value, MC_LEGACY in slots written before it
+  uint8_t  dict;      // dictionary id of the codec, 0 for none
+  uint16_t reserved;
 };
 
 #pragma pack()
 
+// immutable bytes of a cached value, one allocation with the bytes behind the header. the cache
+// and every BlockRef handed out hold a reference.
+struct BlockBuffer
+{
+  std::atomic<int32_t> refs;
+  int32_t len;
+
+  const char* data() const { return (const char*)(this + 1); }
+  char* data() { return (char*)(this + 1); }
+
+  // refs starts at 1, the bytes are left for the caller to fill when data is null
+  static BlockBuffer* Create(const char* data, int32_t len);
+  void AddRef() { refs.fetch_add(1, std::memory_order_relaxed); }
+  void Release();
+};
+
+// a refcounted view of a loaded block. a cached block is handed out without a copy and the view
+// stays valid after the cache drops or rewrites the block.
+class BlockRef
+{
+public:
+  BlockRef() : m_block(nullptr) {}
+  explicit BlockRef(BlockBuffer* block) : m_block(block) {}  // takes over a reference
+  BlockRef(const BlockRef& other) : m_block(other.m_block) { if (m_block) m_block->AddRef(); }
+  BlockRef(BlockRef&& other) : m_block(other.m_block) { other.m_block = nullptr; }
+  ~BlockRef() { if (m_block) m_block->Release(); }
+  BlockRef& operator=(BlockRef other) { std::swap(m_block, other.m_block); return *this; }
+
+  const char* data() const { return m_block ? m_block->data() : ""; }
+  size_t size() const { return m_block ? m_block->len : 0; }
+  bool empty() const { return size() == 0; }
+  std::string str() const { return std::string(data(), size()); }
+  BlockBuffer* get() const { return m_block; }
+
+private:
+  BlockBuffer* m_block;
+};
+
+// one cached copy of the value of a shared slot, the CacheValues of its nodes point at it
+struct SharedBuffer
+{
+  int64_t extentId;
+  int32_t refcount;
+  int32_t len;
+  char* data;
+  BlockBuffer* block;  // holds data
+};
+
+// regions of the W-TinyLFU eviction, a new value enters the window and competes for the main
+// region by access frequency when it leaves it
+enum CacheQueueKind
+{
+  CQ_NONE = 0,
+  CQ_WINDOW,
+  CQ_PROBATION,
+  CQ_PROTECTED,
+};
+
+// written under m_fileLock inside seq, so that a hit can be served without the lock
 struct CacheValue
 {
-  CacheValue() { refcount = 0; len = 0; data = 0; }
-  int64_t refcount;
+  CacheValue() { index = -1; prev = next = 0; queue = CQ_NONE; len = 0; data = 0; block = 0; shared = 0; pending = false; codec = 0; dict = 0; crc = 0; touched = false; }
+  int64_t index;  // node the value belongs to, block is null while the value is unused
+  CacheValue* prev;  // neighbours in the queue of the eviction, m_fileLock only
+  CacheValue* next;
+  uint8_t queue;     // CacheQueueKind
+  SeqLock seq;
+  std::atomic<bool> touched;  // hit without the lock since the eviction last passed it
   int32_t len;
   char* data;
+  BlockBuffer* block;    // holds data, a reference of its own also when shared
+  SharedBuffer* shared;  // data belongs to it when set
+  // data holds the stored bytes of a prefetched slot, checked against crc and decoded on first access
+  bool pending;
+  uint8_t codec;
+  uint8_t dict;
+  uint32_t crc;
+};
+
+// an intrusive LRU list of cache values, the most recently used first
+struct CacheQueue
+{
+  CacheQueue() { head = tail = nullptr; count = 0; }
+  void PushFront(CacheValue* value, uint8_t kind);
+  void Remove(CacheValue* value);
+
+  CacheValue* head;
+  CacheValue* tail;
+  int32_t count;
+};
+
+// a slot of the data file referenced by every node storing the same value, dedup mode
+struct SharedExtent
+{
+  SharedExtent() { id = 0; capacity = 0; len = 0; crc = 0; refcount = 0; }
+  int64_t id;  // never reused, names the cached buffer across compactions
+  uint16_t capacity;
+  uint16_t len;
+  uint32_t crc;
+  int32_t refcount;
 };
 
 #define ROUND(x, mod) (((x) + (mod) - 1) / (mod) * (mod))
 
-const int64_t VALUE_OFFSET = ROUND(sizeof(MyfileHeader), 1024);
+const int64_t LEGACY_VALUE_OFFSET = ROUND(sizeof(MyfileHeaderV1), 1024);
+const int64_t VALUE_OFFSET = ROUND(sizeof(MyfileHeader), 65536);
+const int64_t HEADER_FIELD_BYTES = offsetof(MyfileHeader, page);  // header sync without the page table
+const int64_t HEADER_BYTES = ROUND(sizeof(MyfileHeader), 4096);
+const int64_t INDEX_PAGE_BYTES = INDEX_PAGE_NODES * sizeof(KeyNode);
+const int64_t INDEX_PAGE_BYTES_V3 = INDEX_PAGE_NODES * sizeof(KeyNodeV3);
+const int64_t INDEX_SYNC_BYTES = INDEX_PAGE_BYTES / 64;  // dirty tracking unit, a bit of IndexPage::dirty
+#ifdef WIN32
+const int64_t INDEX_PAGE_STRIDE = ROUND(INDEX_PAGE_BYTES, 65536);  // views start at the allocation granularity
+const int64_t INDEX_PAGE_STRIDE_V3 = ROUND(INDEX_PAGE_BYTES_V3, 65536);
+#else
+const int64_t INDEX_PAGE_STRIDE = INDEX_PAGE_BYTES;
+const int64_t INDEX_PAGE_STRIDE_V3 = INDEX_PAGE_BYTES_V3;
+#endif
 
 enum KVCommandType
 {
@@ -89,6 +279,98 @@ public:
   virtual int OnFlushed(const std::list<KvCommand>& commands) = 0;
 };
 
+// called on the scrub thread for every slot that fails its check
+class MyFileScrubCallback
+{
+public:
+  virtual void OnCorruptBlock(int32_t partition, int64_t pos, const std::string& reason) = 0;
+};
+
+// completions of loadBlockAsync/saveBlockAsync, called on the loop given to StartAsync
+class MyFileAsyncCallback
+{
+public:
+  virtual void OnBlockLoaded(int64_t pos, const std::string& data) = 0;
+  // ok is false when the wal append or the slot write failed, the block keeps its previous value
+  virtual void OnBlockSaved(int64_t pos, bool ok) = 0;
+};
+
+struct MyfileAsyncRequest
+{
+  int64_t pos;
+  bool save;
+  bool ok;
+  std::string data;
+  MyFileAsyncCallback* callback;
+  // a partition share of loadBlocks instead when set, pos is the partition. the caller waits for
+  // remaining to drop to 0
+  std::vector<std::pair<int64_t, std::string*>>* blocks;
+  int32_t* remaining;
+  std::atomic<int64_t>* hits;
+};
+
+struct MyfileCompactionStats
+{
+  int64_t liveBytes;          // bytes the live slots need once packed
+  int64_t fileBytes;          // bytes the data files take on disk
+  float   spaceAmplification; // fileBytes / liveBytes
+  int64_t copiedNodes;        // progress of the running partition
+  int64_t totalNodes;
+  int32_t runningPartition;   // -1 when idle
+  int32_t compactedPartitions;
+  int64_t reclaimedBytes;
+  int64_t freeBytes;          // holes the slot allocator can hand out again
+};
+
+struct MyfileScrubStats
+{
+  int64_t passes;         // completed passes over all partitions
+  int64_t scannedSlots;
+  int64_t scannedBytes;
+  int64_t badSlots;
+  int32_t runningPartition;  // -1 when idle
+};
+
+struct MyfileShardStats
+{
+  int64_t reads;
+  int64_t writes;
+  int64_t writeRuns;  // vectored writes of saveBlocks, each covers a run of adjacent slots
+  int64_t readRuns;   // reads of loadBlocks, each covers the misses close to each other
+  int64_t misses;     // reads served from the data file
+  int64_t lockWaits;  // operations that found the partition lock taken
+  int64_t bufferBytes;  // read buffers held by the partition
+};
+
+enum MyfileShardPolicy
+{
+  MSP_XMOD = 0,  // x % shardCount, the routing of every map written before the policy was stored
+  MSP_MORTON,    // 8x8x8 bricks dealt round robin in Morton order
+  MSP_HASH,      // 8x8x8 bricks scattered by an invertible hash of their Morton code
+  MSP_NUM,
+};
+
+// routes a block to a partition and maps it into the 12 bit per axis key space of that partition.
+// toLocal and toGlobal must be inverse, the keys are stored in the meta and data files.
+class MyfileShardFunction
+{
+public:
+  MyfileShardFunction(int32_t shardCount) : m_shardCount(shardCount) {}
+  virtual ~MyfileShardFunction() {}
+
+  virtual int32_t getPolicy() const = 0;
+  virtual int32_t getShard(int16_t x, int16_t y, int16_t z) const = 0;
+  // local coordinates are in [0, 4096), returns false when the block can not be stored
+  virtual bool toLocal(int16_t x, int16_t y, int16_t z, int32_t& ux, int32_t& uy, int32_t& uz) const = 0;
+  virtual void toGlobal(int32_t shard, int32_t ux, int32_t uy, int32_t uz, int32_t& x, int32_t& y, int32_t& z) const = 0;
+
+  int32_t getShardCount() const { return m_shardCount; }
+
+  static MyfileShardFunction* Create(int32_t policy, int32_t shardCount);
+protected:
+  int32_t m_shardCount;
+};
+
 //point (8 BYTE) -> uint32_t (4 BYTE), memory optimize
 using CacheValueHandle = uint32_t;
 
@@ -109,57 +391,278 @@ private:
   std::list<std::pair<CacheValueHandle, CacheValue*>> m_freelist;
 };
 
+// free holes of a data file, bucketed by 1K capacity class. It is rebuilt from the
+// KeyNode table on Init, the index stays the only persistent record of which slots are used.
+class FreeSlotAllocator
+{
+public:
+  FreeSlotAllocator();
+
+  void clear();
+  void release(int64_t pos, int32_t capacity);
+  // returns -1 when no hole fits, otherwise the hole nearest to hint
+  int64_t alloc(int32_t capacity, int64_t hint);
+  int64_t freeBytes() const { return m_freeBytes; }
+
+private:
+  int classOf(int32_t capacity) const;
+  void insert(int64_t pos, int32_t capacity);
+  void erase(int64_t pos, int32_t capacity);
+
+  std::map<int64_t, int32_t> m_holes;  // pos -> capacity, used for coalescing
+  std::set<int64_t> m_classes[FREE_SLOT_CLASS_NUM];
+  int64_t m_freeBytes;
+};
+
+struct IndexPage
+{
+  int32_t page;              // key >> INDEX_PAGE_BITS
+  int32_t slot;              // position of the page in the meta file
+  KeyNode* node;             // INDEX_PAGE_NODES entries mapped from the meta file
+  CacheValueHandle* handle;  // cache handles of the nodes, CM_CACHE only. stored with release, read unlocked with acquire
+  uint32_t* version;         // bumped by every write and delete of a node, in memory only
+  uint64_t dirty;            // INDEX_SYNC_BYTES ranges of node written since the last sync
+  SeqLock seq;               // len and kind of the nodes change inside it
+};
+
+// a block value saveBlock prepared before taking the partition lock
+struct SlotWrite
+{
+  int64_t index;
+  int64_t globalIndex;
+  const char* data;   // the value as saved, the caller's bytes
+  int dataLen;
+  BlockBuffer* block; // holds data when the caller passed a BlockRef, the cache shares it
+  NodeHeader header;  // written in front of the stored value, padding follows up to capacity
+  std::string compressed;
+  int valueLen;       // of the stored value
+  int len;
+  int capacity;
+  uint8_t codec;
+  uint8_t dict;
+  uint32_t crc;
+  bool inlined;
+  bool dedup;
+  bool changed;
+  int64_t writePos;   // set by placeSlot, -1 when the data file needs no write
+  int writeLen;
+  bool written;
+
+  // the bytes that go to the slot or the KeyNode
+  const char* value() const { return codec == MC_RAW ? data : compressed.c_str(); }
+};
+
 struct MyfilePartition
 {
 public:
   MyfilePartition();
   ~MyfilePartition();
 public:
-  int Init(const std::string &savedir, const std::string &dbfile, int i, CacheMode cacheMode);
+  int Init(const std::string &savedir, const std::string &dbfile, int i, const MyfileShardFunction* shardFunction, BlockCodec* codec, CacheMode cacheMode);
   int UnInit();
 
-  bool saveBlock(int16_t x, int16_t y, int16_t z, const std::string &data, bool changed);
+  static std::string GetDataPath(const std::string &savedir, const std::string &dbfile, int i);
+  // shard count and policy recorded in the meta file, false when the file does not exist
+  static bool ReadShardConfig(const std::string &metapath, int32_t& shardCount, int32_t& shardPolicy);
+
+  // a value out of the local range or too large is dropped with true, stored tells them apart
+  bool saveBlock(int16_t x, int16_t y, int16_t z, const std::string &data, bool changed, bool* stored = nullptr);
+  // saveBlock without copying the value, the cache keeps a reference to it
+  bool saveBlockRef(int16_t x, int16_t y, int16_t z, const BlockRef &data, bool changed);
+  // saves blocks of this partition under one lock, slots that end up adjacent are written together
+  bool saveBlocks(const std::vector<const std::pair<int64_t, std::string>*>& blocks, bool changed);
   std::string loadBlock(int16_t x, int16_t y, int16_t z, bool& bCacheHit);
+  // loadBlock returning a view, a cache hit and a cached miss share the cached bytes
+  BlockRef loadBlockRef(int16_t x, int16_t y, int16_t z, bool& bCacheHit);
+  // loadBlock served from the index or the cache without waiting for the lock, false when that
+  // would need a read or the lock is taken
+  bool loadCachedBlock(int16_t x, int16_t y, int16_t z, std::string& value);
+  // loads blocks of this partition into the strings they point to, the misses are read in file
+  // order with nearby slots merged into one read. returns how many were served without a read.
+  int loadBlocks(const std::vector<std::pair<int64_t, std::string*>>& blocks);
   std::string __directLoadBlock(int16_t x, int16_t y, int16_t z, bool& changed);
 
   bool deleteBlock(int16_t x, int16_t y, int16_t z);
   bool listAllLoadableBlocks(std::vector<int64_t> &dst);
 
-  int32_t getLocalIndex(int16_t x, int16_t y, int16_t z);
-  int64_t getGlobalIndex(int32_t localindex);
+  int64_t getLocalIndex(int16_t x, int16_t y, int16_t z);
+  int64_t getGlobalIndex(int64_t localindex);
+
+  KeyNode* findNode(int64_t index);
+  KeyNode* getNode(int64_t index);  // allocates the index page when needed
+  CacheValueHandle* findHandle(int64_t index);
+  IndexPage* findPage(int64_t index);
+  // serves a cache hit without m_fileLock, copied into value or referenced by ref. false when the
+  // value is not cached, still pending or changing
+  bool readCachedValue(int64_t index, std::string* value, BlockRef* ref);
+  // the KeyNode of index changed and is synced by the next flush, m_fileLock held
+  void markDirty(int64_t index);
 
   void flush();
 
   void GetCacheSummary(int32_t& cacheCount, int32_t& cacheMemoryBytes) { cacheCount = m_cacheNodeCount; cacheMemoryBytes = m_cacheMemoryByte; }
 
   bool GetModifyList(std::vector<int64_t>& v);
-private:
-  int cacheBlock(int32_t index, const std::string& value, bool rewrite_value, bool is_pread);
 
-  int32_t AllocCacheIndex();
+  // rewrite the live slots into a fresh data file and swap it in, reads and writes
+  // keep being served while the slots are copied.
+  int Compact(const std::atomic<bool>* stop);
+  void GetSpaceSummary(int64_t& liveBytes, int64_t& fileBytes, int64_t& freeBytes);
+  void GetCompactProgress(int64_t& copied, int64_t& total) { copied = m_compactCopied; total = m_compactTotal; }
 
-  std::string ProcessReadBuffer(int& readBytes, int& readPos, int index);
+  void GetShardStats(MyfileShardStats& stats);
+
+  // checks every slot against its NodeHeader index and crc in data file order, reading at most
+  // bytesPerSecond through the page cache without keeping what it read there
+  int Scrub(const std::atomic<bool>* stop, int64_t bytesPerSecond, MyFileScrubCallback* callback);
+  void GetScrubSummary(int64_t& slots, int64_t& bytes, int64_t& bad) { slots = m_scrubSlots; bytes = m_scrubBytes; bad = m_scrubBadSlots; }
+
+  // identical values written while dedup is on share one slot, shared slots stay valid with it off
+  void SetDedup(bool dedup) { m_dedup = dedup; }
+  void GetDedupSummary(int64_t& extents, int64_t& refs, int64_t& hits);
+
+  // readahead caches the following slots unchecked, the first load of one verifies it
+  void SetLazyVerify(bool lazy) { m_lazyVerify = lazy; }
+
+  // writes are made durable by the map's wal, saveBlock leaves the slot to the next flush
+  void SetLogged(bool logged) { m_logged = logged; }
+
+  // loads read the data file with O_DIRECT, so blocks are only cached by the partition. the pages
+  // writes leave behind are dropped by flush. false when the file system refuses O_DIRECT.
+  bool SetDirectIO(bool direct);
+
+  // loads read slots straight out of a read-only mapping of the data file instead of reading them
+  // into m_buffer, for maps that are mostly read. takes precedence over SetDirectIO.
+  void SetMappedReads(bool mapped);
+private:
+  void lockFile();
+
+  // a pending header caches the stored bytes of its slot unverified
+  // block, when given, holds value and is shared instead of copied
+  int cacheBlock(int64_t index, const char* value, int len, bool rewrite_value, bool is_pread, const NodeHeader* pending = nullptr, BlockBuffer* block = nullptr);
+  bool verifyCacheValue(int64_t index, CacheValue* cache);
+  // a hit of a cached value counts its frequency and moves it up its queue
+  void touchCache(CacheValue* cache);
+  // a prefetched value is not counted as an access
+  void insertCache(CacheValue* cache, bool is_pread);
+  // evicts until a new value fits the MAX_CACHE and MAX_CACHE_LENGTH budgets
+  void evictCache();
+  void removeCache(CacheValueHandle& handle);
+  void releaseCacheData(CacheValue* cache);
+  // drops the reference of the cache once no hit without the lock can still use block
+  void retireBlock(BlockBuffer* block);
+
+  // buffer holds the data file from bufferPos on
+  std::string ProcessReadBuffer(const char* buffer, int& readBytes, int& readPos, int64_t bufferPos, int64_t index);
+  std::string readInlineNode(const KeyNode& node, int64_t index);
+  // load of a node under m_fileLock. an unlocked load drops the lock while it reads and fails when
+  // the slot changed meanwhile
+  bool loadNode(int64_t index, bool unlocked, bool& bCacheHit, std::string& value);
+  // reopens m_directfile on the current data file, m_fileLock held
+  bool openDirectFile();
+  // maps the data file so that [0, end) is readable, false when end is past the file. m_fileLock held
+  bool mapDataFile(int64_t end);
+  void unmapDataFile();
+
+  IndexPage* mapIndexPage(int32_t slot, int32_t page);
+  IndexPage* allocIndexPage(int32_t page);
+  void unmapIndex();
+  // rewrites a version 1 to 3 index to the current layout
+  int migrateIndex(const std::string& metapath, int16_t version);
+  bool migrateNode(int64_t index, const KeyNodeV3& old, bool patchSlot);
+
+  int copySlot(File* dst, int64_t dstPos, int64_t srcPos, int len, char* buffer);
+  bool checkSlot(const char* slot, int len, int64_t index, bool shared, std::string& reason);
+  void rebuildFreeSlots();
+  void releaseSlot(KeyNode& node);
+  // data stays the caller's and must outlive the write
+  bool prepareSlot(int16_t x, int16_t y, int16_t z, const char* data, int dataLen, BlockBuffer* block, bool changed, SlotWrite& write);
+  // updates the node of write under m_fileLock and picks the position its slot goes to
+  bool placeSlot(SlotWrite& write);
+  void finishSlot(SlotWrite& write, bool written);
+  // places and writes a single slot under the lock
+  bool writeSlot(SlotWrite& write);
+  // header, value and padding of a placed slot
+  void appendSlotBuffers(const SlotWrite& write, std::vector<FileBuffer>& buffers);
+  // position of a shared slot holding the same value as write, -1 when there is none
+  int64_t findSharedExtent(const SlotWrite& write);
+  void addSharedExtent(int64_t pos, const SharedExtent& extent);
+  int recoverCompaction(bool compacting);
+  // syncs the header and the index ranges marked dirty, collectDirty takes them under m_fileLock
+  void syncHeader();
+  void collectDirty(std::vector<std::pair<char*, int64_t>>& ranges);
+  void markAllDirty();
 public:
   File* m_datafile;
   File* m_metafile;
   MyfileHeader* m_header;
-  char* m_buffer; // 64K
-
-  std::list<int32_t> m_accessCacheFIFO;
-  std::list<int32_t> m_prereadCacheFIFO;
+  char* m_buffer; // 64K, reads under m_fileLock
+  IoRing* m_ring;  // loadBlocks reads, null without io_uring
+  uv_mutex_t m_ringLock;  // serializes the batches of m_ring, never taken while m_fileLock is held
+  File* m_directfile;  // O_DIRECT handle of the data file for the loads, null when off
+  bool m_directIO;
+  AlignedBufferPool m_bufferPool;
+  bool m_mappedReads;
+  char* m_dataMap;          // read-only view of the data file, null until a load needs it
+  int64_t m_dataMapBytes;   // size of the view
+  int64_t m_dataMapLength;  // file length when last checked, the view is readable up to it
+
+  EpochReclaimer m_reclaimer;  // blocks the cache dropped, released once no lock-free hit can use them
+  CacheQueue m_cacheWindow;
+  CacheQueue m_cacheProbation;
+  CacheQueue m_cacheProtected;
+  FrequencySketch m_cacheSketch;  // accesses of recently cached indexes
   CacheValueAllocator m_cacheAllocator;
-  CacheValueHandle* m_node;   //2M * 4 = 8M
+  IndexPage** m_pageDir[INDEX_DIR_SIZE];
+  std::vector<IndexPage*> m_pages;  // by meta file slot
+  std::vector<IndexPage*> m_dirtyPages;
+  int64_t m_headerDirty;  // header bytes to sync, the page table is only synced when it changed
   bool m_metadataChanged;
-#ifdef WIN32
-  HANDLE m_hFileMapping;
-#endif
   uv_mutex_t m_fileLock;
+  uv_rwlock_t m_swapLock;  // held shared by the reads outside m_fileLock, the data file handles change only under it
   uint32_t m_cacheNodeCount;
 
   uint32_t m_cacheMemoryByte;
 
   CacheMode m_cacheMode;
   int32_t m_index;
+  const MyfileShardFunction* m_shardFunction;
+  BlockCodec* m_codec;
+  int32_t m_checksum;  // ChecksumType of m_header
+
+  std::string m_datapath;
+  int64_t m_liveBytes;
+
+  FreeSlotAllocator m_freeSlots;
+  // slots released since the last flush, reused only after the header no longer points at them on disk
+  std::vector<std::pair<int64_t, int32_t>> m_pendingFreeSlots;
+  int32_t m_dataGeneration;  // bumped whenever a compaction swaps the data file
+
+  bool m_lazyVerify;
+  bool m_logged;
+  bool m_dedup;
+  std::map<int64_t, SharedExtent> m_sharedExtents;         // by pos, rebuilt from the flagged nodes on Init
+  std::unordered_multimap<uint64_t, int64_t> m_sharedContent;  // crc and len -> pos
+  std::map<int64_t, SharedBuffer*> m_sharedBuffers;        // by extent id
+  int64_t m_nextExtentId;
+  std::atomic<int64_t> m_dedupHits;
+
+  bool m_compacting;
+  std::vector<int64_t> m_compactDirty;  // nodes written while the compactor copies
+  std::atomic<int64_t> m_compactCopied;
+  std::atomic<int64_t> m_compactTotal;
+
+  std::atomic<int64_t> m_readCount;
+  std::atomic<int64_t> m_writeCount;
+  std::atomic<int64_t> m_writeRuns;
+  std::atomic<int64_t> m_readRuns;
+  int64_t m_appendPos;  // end of the slots a batch appended but did not write yet
+  std::atomic<int64_t> m_missCount;
+  std::atomic<int64_t> m_lockWaitCount;
+
+  std::atomic<int64_t> m_scrubSlots;
+  std::atomic<int64_t> m_scrubBytes;
+  std::atomic<int64_t> m_scrubBadSlots;
 };
 
 enum MyFileState
@@ -192,6 +695,7 @@ public:
   int32_t getId() const  { return m_configId; }
 
   bool __directSaveBlock(int64_t pos, const std::string &data, bool changed);
+  bool __directSaveBlocks(const std::vector<std::pair<int64_t, std::string>>& blocks, bool changed);
   bool __directDeleteBlock(int64_t pos);
   std::string __directLoadBlock(int64_t pos, bool& changed);
 
@@ -211,26 +715,113 @@ public:
   bool GetModifyList(std::vector<int64_t>& v);
 
   int64_t GetCreateTime() const { return m_createTime; }
+
+  // background compaction of the partitions whose space amplification reaches minAmplification
+  bool StartCompaction(float minAmplification);
+  void StopCompaction();
+  bool IsCompacting() const { return m_compactPartition >= 0; }
+  void GetCompactionStats(MyfileCompactionStats& stats);
+
+  // background scrubber, passes over all partitions every intervalSeconds, 0 runs a single pass
+  bool StartScrub(int64_t bytesPerSecond, int32_t intervalSeconds);
+  void StopScrub();
+  bool IsScrubbing() const { return m_scrubRunning; }
+  void SetScrubCallback(MyFileScrubCallback* callback) { m_scrubCallback = callback; }
+  void GetScrubStats(MyfileScrubStats& stats);
+
+  // shard count and policy of a new map, must be set before Init, MYSQL_BLOCK_TABLE_NUM and
+  // MSP_XMOD when unset. existing maps keep the ones of their header.
+  void SetShardCount(int32_t shardCount) { m_shardCount = shardCount; }
+  int32_t GetShardCount() const { return m_shardCount; }
+  void SetShardPolicy(int32_t shardPolicy) { m_shardPolicy = shardPolicy; }
+  int32_t GetShardPolicy() const { return m_shardPolicy; }
+
+  void GetShardStats(std::vector<MyfileShardStats>& stats);
+
+  // store identical blocks once, see MyfilePartition::SetDedup
+  void SetDedup(bool dedup);
+  void GetDedupStats(int64_t& extents, int64_t& refs, int64_t& hits);
+
+  // see MyfilePartition::SetLazyVerify, on by default
+  void SetLazyVerify(bool lazy);
+
+  // see MyfilePartition::SetDirectIO, off by default
+  void SetDirectIO(bool direct);
+  // see MyfilePartition::SetMappedReads, off by default
+  void SetMappedReads(bool mapped);
+
+  // log block writes to a wal, they are durable once saveBlock/deleteBlock return true and the
+  // partitions are only synced by forceflush. must be set before Init, off by default. the wal
+  // left by an unclean shutdown is replayed by Init either way.
+  void SetWal(bool wal) { m_walEnabled = wal; }
+  void GetWalStats(MyfileWalStats& stats) { m_wal.GetStats(stats); }
+
+  // codec of new writes, slots keep the codec they were written with
+  void SetCompression(int32_t codec, int32_t level) { m_codec.SetCodec(codec, level); }
+  // trains a dictionary for new writes from up to sampleCount stored blocks
+  int TrainDictionary(int32_t sampleCount, int32_t maxBytes);
+
+  // rewrite a closed map to shardCount partitions routed by shardPolicy and stored with codec, with
+  // the given number of copy threads. the new partitions are built aside and swapped in at the end,
+  // Init finishes an interrupted swap.
+  static int Reshard(const std::string &savedir, const std::string &dbfile, int32_t shardCount, int32_t shardPolicy, int32_t codec, int threads);
     
   // 地图生成工具保存block接口
   bool saveBlock(const v3s16 &pos, const std::string &data) override;
+  // saveBlock of a value the caller built in a BlockBuffer, written and cached without a copy
+  bool saveBlockRef(const v3s16 &pos, const BlockRef &data);
+  // saves many blocks at once, each partition is locked once for its share
+  bool saveBlocks(const std::vector<std::pair<int64_t, std::string>>& blocks);
     
   std::string loadBlock(const v3s16 &pos) override;
+  // loadBlock without copying a cached block, the view is immutable and may be kept
+  BlockRef loadBlockRef(const v3s16 &pos);
+  // resolves the blocks against the index of every partition at once, partitions with misses
+  // read in parallel
+  void loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> &values) override;
+  void loadBlocks(const std::vector<int64_t> &pos, std::vector<std::string> &values);
   bool deleteBlock(const v3s16 &pos) override;
+
+  // loads and saves that never block the loop: StartAsync starts threads I/O threads for them and
+  // their callbacks run on loop. StartAsync, StopAsync and the async calls are made on the loop
+  // thread, StopAsync completes the queued calls before it returns.
+  bool StartAsync(uv_loop_t* loop, int threads);
+  void StopAsync();
+  // a block found in the cache completes before loadBlockAsync returns, false when not started
+  bool loadBlockAsync(const v3s16 &pos, MyFileAsyncCallback* callback);
+  bool saveBlockAsync(const v3s16 &pos, const std::string &data, MyFileAsyncCallback* callback);
     
 private:
   bool saveBlock(int64_t pos, const std::string &data);
   bool deleteBlock(int64_t pos);
     
 private:
-  int getTableIndex(int64_t x);
+  int getTableIndex(int16_t x, int16_t y, int16_t z);
+  void compactThread(float minAmplification);
+  void scrubThread(int64_t bytesPerSecond, int32_t intervalSeconds);
+  void asyncThread(int32_t worker);
+  bool loadCachedBlock(int64_t pos, std::string& value);
+  void completeAsync();
+  static void onAsyncDone(uv_async_t* handle);
+  static int finishReshard(const std::string &savedir, const std::string &dbfile);
 private:
   std::string m_savedir;
   std::string m_dbfile;
 
   MyFileFlushCallback* m_callback;
 
-  MyfilePartition m_stmt[MYSQL_BLOCK_TABLE_NUM];
+  int32_t m_shardCount;
+  int32_t m_shardPolicy;
+  MyfileShardFunction* m_shardFunction;
+  bool m_dedup;
+  bool m_lazyVerify;
+  bool m_directIO;
+  bool m_mappedReads;
+  BlockCodec m_codec;
+  bool m_walEnabled;
+  MyfileWal m_wal;
+  uv_rwlock_t m_walLock;  // shared by the writers, a checkpoint takes it to rotate the wal
+  std::vector<MyfilePartition*> m_stmt;
   int m_wheelIndex;
 
   uv_timer_t m_timerWrite;
@@ -240,7 +831,7 @@ private:
   std::map<int64_t, std::string> m_valueCache;
   uv_mutex_t m_cacheLock;
 
-  std::list<KvCommand>    m_pendingWriteRequest[MYSQL_BLOCK_TABLE_NUM];
+  std::vector<std::list<KvCommand>> m_pendingWriteRequest;
   uv_mutex_t m_flushLock;
 
   int32_t    m_configId;
@@ -255,6 +846,29 @@ private:
   MyFileState             m_state;
 
   int64_t                 m_createTime;
+
+  std::thread             m_compactThread;
+  std::atomic<bool>       m_compactStop;
+  std::atomic<int32_t>    m_compactPartition;
+  std::atomic<int32_t>    m_compactedPartitions;
+  std::atomic<int64_t>    m_compactReclaimedBytes;
+
+  std::thread             m_scrubThread;
+  std::atomic<bool>       m_scrubStop;
+  std::atomic<bool>       m_scrubRunning;
+  std::atomic<int32_t>    m_scrubPartition;
+  std::atomic<int64_t>    m_scrubPasses;
+  MyFileScrubCallback*    m_scrubCallback;
+
+  uv_async_t*             m_asyncDone;  // on the loop of StartAsync, null when not started
+  std::vector<std::thread> m_asyncThreads;
+  std::vector<std::list<MyfileAsyncRequest*>> m_asyncQueues;  // one per thread, a block always goes to the same one
+  std::list<MyfileAsyncRequest*> m_asyncCompleted;
+  std::map<int64_t, int32_t> m_asyncSaves;  // queued saves per block, loads of them queue up behind
+  uv_mutex_t              m_asyncLock;
+  uv_cond_t               m_asyncCond;
+  uv_cond_t               m_asyncShares;  // loadBlocks shares finished on the async threads
+  bool                    m_asyncStop;
 };
 
 #endif  //! #ifndef DATABASE_MYFILE_HEADER
@@ -84,6 +84,13 @@ bool Database::getIntegerAsBlock(int64_t i, int16_t& x, int16_t& y, int16_t& z)
     return true;
 }
 
+void Database::loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> &values)
+{
+	values.resize(pos.size());
+	for (size_t i = 0; i < pos.size(); ++i)
+		values[i] = loadBlock(pos[i]);
+}
+
 v3s16 Database::getIntegerAsNode(s64 i)
 {
     v3s16 pos;
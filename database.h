@@ -47,6 +47,8 @@ public:
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data) = 0;
 	virtual std::string loadBlock(const v3s16 &pos) = 0;
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
+	// loads the blocks of pos into values, in the same order. one loadBlock each by default
+	virtual void loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> &values);
 
 	static s64 getBlockAsInteger(const v3s16 &pos);
     static int64_t getBlockAsInteger(int16_t x, int16_t y, int16_t z);
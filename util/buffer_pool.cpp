@@ -0,0 +1,91 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+#ifdef WIN32
+# include <malloc.h>
+#endif
+
+static char* AllocAligned(int64_t size)
+{
+#ifdef WIN32
+  return (char*)_aligned_malloc(size, ALIGNED_BUFFER_ALIGN);
+#else
+  void* p = nullptr;
+  return posix_memalign(&p, ALIGNED_BUFFER_ALIGN, size) == 0 ? (char*)p : nullptr;
+#endif
+}
+
+static void FreeAligned(char* p)
+{
+#ifdef WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+AlignedBufferPool::AlignedBufferPool()
+{
+  m_bytes = 0;
+  uv_mutex_init(&m_lock);
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+  for (int c = 0; c < ALIGNED_BUFFER_CLASSES; ++c)
+  {
+    for (size_t i = 0; i < m_free[c].size(); ++i)
+      FreeAligned(m_free[c][i]);
+  }
+  uv_mutex_destroy(&m_lock);
+}
+
+int AlignedBufferPool::classOf(int size)
+{
+  int c = 0;
+  while (c < ALIGNED_BUFFER_CLASSES && ((int64_t)ALIGNED_BUFFER_ALIGN << c) < size)
+    ++c;
+  return c;
+}
+
+char* AlignedBufferPool::Alloc(int size)
+{
+  int c = classOf(size);
+  if (c < ALIGNED_BUFFER_CLASSES)
+  {
+    uv_mutex_lock(&m_lock);
+    if (!m_free[c].empty())
+    {
+      char* buffer = m_free[c].back();
+      m_free[c].pop_back();
+      uv_mutex_unlock(&m_lock);
+      return buffer;
+    }
+    uv_mutex_unlock(&m_lock);
+  }
+
+  int64_t bytes = c < ALIGNED_BUFFER_CLASSES ? ((int64_t)ALIGNED_BUFFER_ALIGN << c) : size;
+  char* buffer = AllocAligned(bytes);
+  if (buffer)
+    m_bytes += bytes;
+  return buffer;
+}
+
+void AlignedBufferPool::Free(char* buffer, int size)
+{
+  if (!buffer)
+    return;
+  int c = classOf(size);
+  if (c < ALIGNED_BUFFER_CLASSES)
+  {
+    uv_mutex_lock(&m_lock);
+    if (m_free[c].size() < ALIGNED_BUFFER_KEEP)
+    {
+      m_free[c].push_back(buffer);
+      uv_mutex_unlock(&m_lock);
+      return;
+    }
+    uv_mutex_unlock(&m_lock);
+  }
+  FreeAligned(buffer);
+  m_bytes -= c < ALIGNED_BUFFER_CLASSES ? ((int64_t)ALIGNED_BUFFER_ALIGN << c) : size;
+}
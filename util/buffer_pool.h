@@ -0,0 +1,37 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include "uv.h"
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#define ALIGNED_BUFFER_ALIGN   4096
+#define ALIGNED_BUFFER_CLASSES 13  // 4K to 16M, larger buffers are not kept
+#define ALIGNED_BUFFER_KEEP    4   // released buffers kept per class
+
+// buffers aligned for O_DIRECT reads. released buffers are kept by power of two size and handed
+// out again, so the memory behind the reads stays within what the largest batches needed.
+class AlignedBufferPool
+{
+public:
+  AlignedBufferPool();
+  ~AlignedBufferPool();
+
+  // at least size bytes, null when the allocation fails
+  char* Alloc(int size);
+  // size as passed to Alloc
+  void Free(char* buffer, int size);
+
+  // allocated by the pool, in use or kept
+  int64_t GetBytes() const { return m_bytes; }
+
+private:
+  static int classOf(int size);
+
+  uv_mutex_t m_lock;
+  std::vector<char*> m_free[ALIGNED_BUFFER_CLASSES];
+  std::atomic<int64_t> m_bytes;
+};
+
+#endif  //! #ifndef _BUFFER_POOL_H_
@@ -0,0 +1,135 @@
+#include "checksum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+# define CHECKSUM_X64
+# include <nmmintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
+
+namespace checksum
+{
+
+// the slicing tables assume little endian loads
+struct SliceTable
+{
+  explicit SliceTable(uint32_t poly)
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k)
+        crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      for (int k = 1; k < 8; ++k)
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+  }
+
+  uint32_t table[8][256];
+};
+
+static const SliceTable& Crc32Table()
+{
+  static const SliceTable table(0xEDB88320);
+  return table;
+}
+
+static const SliceTable& Crc32cTable()
+{
+  static const SliceTable table(0x82F63B78);
+  return table;
+}
+
+// 8 bytes per step instead of boost's one
+static uint32_t SliceBy8(const SliceTable& slice, const uint8_t* p, size_t len)
+{
+  const uint32_t (*t)[256] = slice.table;
+  uint32_t crc = 0xFFFFFFFF;
+  while (len >= 8)
+  {
+    uint32_t one, two;
+    memcpy(&one, p, 4);
+    memcpy(&two, p + 4, 4);
+    one ^= crc;
+    crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+      ^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+#ifdef CHECKSUM_X64
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t Crc32cHardware(const uint8_t* p, size_t len)
+{
+  uint64_t crc = 0xFFFFFFFF;
+  while (len >= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = _mm_crc32_u64(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  uint32_t crc32 = (uint32_t)crc;
+  while (len-- > 0)
+    crc32 = _mm_crc32_u8(crc32, *p++);
+  return ~crc32;
+}
+
+static bool DetectSse42()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+bool HasHardwareCrc32c()
+{
+#ifdef CHECKSUM_X64
+  static const bool supported = DetectSse42();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+bool IsSupported(int32_t type)
+{
+  return type >= 0 && type < CT_NUM;
+}
+
+uint32_t Compute(int32_t type, const void* data, size_t len)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  if (len == 0)
+    return 0;
+
+  if (type == CT_CRC32C)
+  {
+#ifdef CHECKSUM_X64
+    if (HasHardwareCrc32c())
+      return Crc32cHardware(p, len);
+#endif
+    return SliceBy8(Crc32cTable(), p, len);
+  }
+  return SliceBy8(Crc32Table(), p, len);
+}
+
+}
@@ -0,0 +1,25 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum ChecksumType
+{
+  CT_CRC32 = 0,  // zlib polynomial, the one of boost::crc_32_type
+  CT_CRC32C,     // Castagnoli polynomial, the SSE4.2 crc32 instruction
+  CT_NUM,
+};
+
+namespace checksum
+{
+  // checksum of len bytes, 0 for none. picks the fastest implementation the CPU supports.
+  uint32_t Compute(int32_t type, const void* data, size_t len);
+
+  bool IsSupported(int32_t type);
+
+  // true when CT_CRC32C runs on the crc32 instruction
+  bool HasHardwareCrc32c();
+}
+
+#endif  //! #ifndef _CHECKSUM_H_
@@ -0,0 +1,73 @@
+#include "epoch.h"
+#include <thread>
+#include <functional>
+
+EpochReclaimer::EpochReclaimer()
+{
+  m_epoch = 2;
+  for (int i = 0; i < EPOCH_READER_STRIPES; ++i)
+    m_stripes[i].readers[0] = m_stripes[i].readers[1] = 0;
+}
+
+EpochReclaimer::~EpochReclaimer()
+{
+  Clear();
+}
+
+int EpochReclaimer::Enter()
+{
+  int stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % EPOCH_READER_STRIPES;
+  for (;;)
+  {
+    uint64_t epoch = m_epoch.load(std::memory_order_seq_cst);
+    int parity = epoch & 1;
+    m_stripes[stripe].readers[parity].fetch_add(1, std::memory_order_seq_cst);
+    // Reclaim either counted this reader or moved on before it, then it starts over
+    if (m_epoch.load(std::memory_order_seq_cst) == epoch)
+      return stripe * 2 + parity;
+    m_stripes[stripe].readers[parity].fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void EpochReclaimer::Exit(int token)
+{
+  m_stripes[token / 2].readers[token & 1].fetch_sub(1, std::memory_order_release);
+}
+
+void EpochReclaimer::Retire(void* object, void (*release)(void*))
+{
+  Retired retired = { m_epoch.load(std::memory_order_relaxed), object, release };
+  m_retired.push_back(retired);
+  if (m_retired.size() >= EPOCH_RECLAIM_BATCH)
+    Reclaim();
+}
+
+void EpochReclaimer::Reclaim()
+{
+  // the readers of epoch - 1 share the counters the next epoch uses
+  uint64_t epoch = m_epoch.load(std::memory_order_relaxed);
+  int previous = (epoch - 1) & 1;
+  int32_t readers = 0;
+  for (int i = 0; i < EPOCH_READER_STRIPES; ++i)
+    readers += m_stripes[i].readers[previous].load(std::memory_order_seq_cst);
+  if (readers == 0)
+    m_epoch.store(++epoch, std::memory_order_seq_cst);
+
+  // a reader that found an object entered no later than its retirement, and those are gone two epochs on
+  size_t kept = 0;
+  for (size_t i = 0; i < m_retired.size(); ++i)
+  {
+    if (m_retired[i].epoch + 2 <= epoch)
+      m_retired[i].release(m_retired[i].object);
+    else
+      m_retired[kept++] = m_retired[i];
+  }
+  m_retired.resize(kept);
+}
+
+void EpochReclaimer::Clear()
+{
+  for (size_t i = 0; i < m_retired.size(); ++i)
+    m_retired[i].release(m_retired[i].object);
+  m_retired.clear();
+}
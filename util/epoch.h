@@ -0,0 +1,73 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#define EPOCH_READER_STRIPES 16  // reader counters, threads spread over them by id
+#define EPOCH_RECLAIM_BATCH  64  // retired objects that make Retire try to reclaim
+
+// a sequence counter for data read without the lock its writers hold. a writer brackets its
+// changes with WriteBegin and WriteEnd, a reader whose ReadValid fails saw a torn state.
+class SeqLock
+{
+public:
+  SeqLock() : m_seq(0) {}
+
+  void WriteBegin()
+  {
+    m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void WriteEnd() { m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  uint32_t ReadBegin() const { return m_seq.load(std::memory_order_acquire); }
+  bool ReadValid(uint32_t seq) const
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (seq & 1) == 0 && m_seq.load(std::memory_order_relaxed) == seq;
+  }
+
+private:
+  std::atomic<uint32_t> m_seq;  // odd while a write runs
+};
+
+// epoch based reclamation for objects readers find without a lock. a reader stays between Enter
+// and Exit while it uses what it found, an object unlinked by a writer is passed to Retire and
+// released once every reader that could have found it has left. Retire and Reclaim are called
+// under the lock of the writers.
+class EpochReclaimer
+{
+public:
+  EpochReclaimer();
+  ~EpochReclaimer();
+
+  // returns the token for Exit
+  int Enter();
+  void Exit(int token);
+
+  void Retire(void* object, void (*release)(void*));
+  // moves the epoch on when the readers allow it and releases what no reader can hold anymore
+  void Reclaim();
+  // releases everything retired, no reader may be inside
+  void Clear();
+
+private:
+  struct Retired
+  {
+    uint64_t epoch;
+    void* object;
+    void (*release)(void*);
+  };
+  struct alignas(64) Stripe
+  {
+    std::atomic<int32_t> readers[2];  // by epoch parity
+  };
+
+  std::atomic<uint64_t> m_epoch;
+  Stripe m_stripes[EPOCH_READER_STRIPES];
+  std::vector<Retired> m_retired;
+};
+
+#endif  //! #ifndef _EPOCH_H_
@@ -7,6 +7,13 @@
     #include <sys/stat.h>
     #include <sys/wait.h>
     #include <unistd.h>
+    #include <stdio.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <vector>
+    #include <algorithm>
 #endif
 
 namespace fs_system
@@ -55,6 +62,24 @@ bool DeleteEmptyDirectory(std::string path)
   return did;
 }
 
+bool DeleteSingleFile(std::string path)
+{
+  if (DeleteFile(path.c_str()) == TRUE)
+    return true;
+  return GetLastError() == ERROR_FILE_NOT_FOUND;
+}
+
+bool Rename(const std::string &from, const std::string &to)
+{
+  return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) == TRUE;
+}
+
+bool SyncParentDir(const std::string &)
+{
+  // NTFS journals its metadata, a directory can not be flushed
+  return true;
+}
+
 #else // POSIX
 
 bool CreateDir(std::string path)
@@ -99,6 +124,39 @@ bool DeleteEmptyDirectory(std::string path)
   return did;
 }
 
+bool DeleteSingleFile(std::string path)
+{
+  if (unlink(path.c_str()) == 0)
+    return true;
+  return errno == ENOENT;
+}
+
+bool Rename(const std::string &from, const std::string &to)
+{
+  bool did = (rename(from.c_str(), to.c_str()) == 0);
+  if (!did)
+    LOG(ERROR) << "rename errno: " << errno << ": " << strerror(errno);
+  return did;
+}
+
+bool SyncParentDir(const std::string &path)
+{
+  std::string dir = RemoveLastPathComponent(path);
+  if (dir.empty())
+    dir = IsDirDelimiter(path[0]) ? DIR_DELIM : ".";
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+  {
+    LOG(ERROR) << "open dir errno: " << errno << ": " << strerror(errno) << " " << dir;
+    return false;
+  }
+  bool did = (fsync(fd) == 0);
+  if (!did)
+    LOG(ERROR) << "fsync dir errno: " << errno << ": " << strerror(errno) << " " << dir;
+  close(fd);
+  return did;
+}
+
 #endif  // // POSIX
 
 std::string RemoveLastPathComponent(std::string path,
@@ -207,6 +265,37 @@ File::~File()
   Close();
 }
 
+int File::ReadBatch(FileRequest* requests, int count, IoRing* ring)
+{
+  for (int i = 0; i < count; ++i)
+    requests[i].result = -1;
+
+#ifndef WIN32
+  for (int i = 0; ring && ring->IsValid() && i < count;)
+  {
+    int first = i;
+    while (i < count && ring->Prepare(file_, &requests[i]))
+      ++i;
+    if (i == first || ring->Run() < 0)
+      break;
+  }
+#endif
+
+  int done = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    FileRequest& request = requests[i];
+    if (request.result != request.size)
+    {
+      int got = request.result > 0 ? request.result : 0;
+      int rv = Read(request.offset + got, request.data + got, request.size - got);
+      request.result = rv > 0 ? got + rv : (got > 0 ? got : rv);
+    }
+    done += (request.result == request.size);
+  }
+  return done;
+}
+
 #ifdef WIN32
 
 File::File(const std::string& name, uint32_t flags)
@@ -278,6 +367,29 @@ int File::Write(int64_t offset, const char* data, int size)
   return bytes_written;
 }
 
+int File::WriteV(int64_t offset, const FileBuffer* buffers, int count)
+{
+  int bytes_written = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    int this_written = Write(offset + bytes_written, buffers[i].data, buffers[i].size);
+    if (this_written > 0)
+      bytes_written += this_written;
+    if (this_written != buffers[i].size)
+      break;
+  }
+  return bytes_written;
+}
+
+int File::ReadUncached(int64_t offset, char* data, int size)
+{
+  return Read(offset, data, size);
+}
+
+void File::DropCache()
+{
+}
+
 bool File::IsValid() const
 {
   return file_ != INVALID_HANDLE_VALUE;
@@ -387,6 +499,84 @@ int File::Write(int64_t offset, const char* data, int size)
   return bytes_written ? bytes_written : rv;
 }
 
+int File::WriteV(int64_t offset, const FileBuffer* buffers, int count)
+{
+  std::vector<struct iovec> iov(count);
+  for (int i = 0; i < count; ++i)
+  {
+    iov[i].iov_base = (void*)buffers[i].data;
+    iov[i].iov_len = buffers[i].size;
+  }
+
+  int bytes_written = 0;
+  int first = 0;
+  ssize_t rv = 0;
+  while (first < count)
+  {
+    if (iov[first].iov_len == 0)
+    {
+      ++first;
+      continue;
+    }
+    rv = HANDLE_EINTR(pwritev(file_, &iov[first], std::min(count - first, IOV_MAX), offset + bytes_written));
+    if (rv <= 0)
+      break;
+
+    // a short write leaves the rest of the buffers for the next round
+    bytes_written += rv;
+    while (first < count && rv >= (ssize_t)iov[first].iov_len)
+      rv -= iov[first++].iov_len;
+    if (first < count)
+    {
+      iov[first].iov_base = (char*)iov[first].iov_base + rv;
+      iov[first].iov_len -= rv;
+    }
+  }
+
+  return bytes_written ? bytes_written : (rv < 0 ? -1 : 0);
+}
+
+int File::ReadUncached(int64_t offset, char* data, int size)
+{
+  if (size <= 0)
+    return Read(offset, data, size);
+
+  // which pages are cached already, an unreadable residency counts as cached
+  int64_t pageSize = sysconf(_SC_PAGESIZE);
+  int64_t begin = offset / pageSize * pageSize;
+  int64_t length = offset + size - begin;
+  std::vector<unsigned char> resident((length + pageSize - 1) / pageSize, 1);
+  void* p = mmap(NULL, length, PROT_READ, MAP_SHARED, file_, begin);
+  if (p != MAP_FAILED)
+  {
+    if (mincore(p, length, &resident[0]) != 0)
+      std::fill(resident.begin(), resident.end(), 1);
+    munmap(p, length);
+  }
+
+  int rv = Read(offset, data, size);
+
+  for (size_t i = 0; i < resident.size();)
+  {
+    if (resident[i] & 1)
+    {
+      ++i;
+      continue;
+    }
+    size_t j = i;
+    while (j < resident.size() && !(resident[j] & 1))
+      ++j;
+    posix_fadvise(file_, begin + i * pageSize, (j - i) * pageSize, POSIX_FADV_DONTNEED);
+    i = j;
+  }
+  return rv;
+}
+
+void File::DropCache()
+{
+  posix_fadvise(file_, 0, 0, POSIX_FADV_DONTNEED);
+}
+
 typedef struct stat64 stat_wrapper_t;
 static int CallFstat(int fd, stat_wrapper_t *sb)
 {
@@ -406,14 +596,14 @@ bool File::Flush(bool onlyData)
 {
   {HANDLE_EINTR(sync_file_range(file_, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER));}
   if (onlyData) { 
-    return HANDLE_EINTR(fdatasync(file_));
+    return HANDLE_EINTR(fdatasync(file_)) == 0;
   }
-  return HANDLE_EINTR(fsync(file_));
+  return HANDLE_EINTR(fsync(file_)) == 0;
 }
 
 bool File::TryFlush(int64_t offset, int64_t size)
 {
-  return HANDLE_EINTR(sync_file_range(file_, offset, size, SYNC_FILE_RANGE_WRITE));
+  return HANDLE_EINTR(sync_file_range(file_, offset, size, SYNC_FILE_RANGE_WRITE)) == 0;
 }
 
 bool File::IsValid() const
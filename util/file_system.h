@@ -3,6 +3,7 @@
 
 #include "uv.h"
 #include "easylogging++.h"
+#include "io_ring.h"
 #include <assert.h>
 #include <string>
 #include <iostream>
@@ -28,6 +29,16 @@ namespace fs_system
 
   bool DeleteEmptyDirectory(std::string path);
 
+  // Deletes a regular file, returns true if it is gone afterwards.
+  bool DeleteSingleFile(std::string path);
+
+  // Renames |from| to |to|, replacing |to| if it already exists.
+  bool Rename(const std::string &from, const std::string &to);
+
+  // Syncs the directory holding |path|, so that renames, creations and deletions in it survive a
+  // power loss. Returns true on success.
+  bool SyncParentDir(const std::string &path);
+
   // Create all directories on the given path that don't already exist.
   bool CreateAllDirs(std::string path);
 
@@ -44,6 +55,13 @@ namespace fs_system
   std::string RemoveRelativePathComponents(std::string path);
 }//fs
 
+// one piece of a vectored write
+struct FileBuffer
+{
+  const char* data;
+  int size;
+};
+
 class File
 {
 public:
@@ -69,6 +87,19 @@ public:
   // an error.
   int Read(int64_t offset, char* data, int size);
 
+  // Reads like Read, but drops the pages the read brought into the page cache
+  // again, so a scan does not evict the hot data. Plain Read on Windows.
+  int ReadUncached(int64_t offset, char* data, int size);
+
+  // Drops the clean pages of the file from the page cache, written pages are
+  // only dropped once they reached the disk. Does nothing on Windows.
+  void DropCache();
+
+  // Reads every request, all of them in flight at once through |ring| when one
+  // is given, otherwise one Read after another. What the ring leaves short is
+  // finished with Read. Returns the number of requests read completely.
+  int ReadBatch(FileRequest* requests, int count, IoRing* ring);
+
   // Writes the given buffer into the file at the given offset, overwritting any
   // data that was previously there. Returns the number of bytes written, or -1
   // on error. Note that this function makes a best effort to write all data on
@@ -77,6 +108,11 @@ public:
   // with FLAG_APPEND.
   int Write(int64_t offset, const char* data, int size);
 
+  // Writes the buffers back to back starting at the given offset, with a single
+  // pwritev where the platform has it. Returns the number of bytes written, or -1
+  // on error.
+  int WriteV(int64_t offset, const FileBuffer* buffers, int count);
+
   // Flushes the buffers.
   bool Flush(bool onlyData);
 
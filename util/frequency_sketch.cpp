@@ -0,0 +1,74 @@
+#include "frequency_sketch.h"
+#include <string.h>
+
+static const uint64_t SEEDS[SKETCH_DEPTH] = {
+  0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL };
+
+FrequencySketch::FrequencySketch(int32_t capacity)
+{
+  int64_t words = 1;
+  while (words < capacity / 4)
+    words <<= 1;
+  m_table = new uint64_t[words];
+  m_mask = words - 1;
+  m_sampleSize = (int64_t)SKETCH_SAMPLE_RATE * (capacity > 0 ? capacity : 1);
+  Clear();
+}
+
+FrequencySketch::~FrequencySketch()
+{
+  delete[] m_table;
+}
+
+void FrequencySketch::Clear()
+{
+  memset(m_table, 0, (m_mask + 1) * sizeof(uint64_t));
+  m_additions = 0;
+}
+
+uint64_t FrequencySketch::hash(uint64_t key, int row)
+{
+  uint64_t h = (key + SEEDS[row]) * 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 31;
+  h *= 0x94D049BB133111EBULL;
+  return h ^ (h >> 29);
+}
+
+void FrequencySketch::Increment(uint64_t key)
+{
+  bool added = false;
+  for (int row = 0; row < SKETCH_DEPTH; ++row)
+  {
+    uint64_t h = hash(key, row);
+    uint64_t& word = m_table[h & m_mask];
+    int shift = (int)((h >> 60) << 2);
+    if (((word >> shift) & SKETCH_MAX_COUNT) != SKETCH_MAX_COUNT)
+    {
+      word += 1ULL << shift;
+      added = true;
+    }
+  }
+  if (added && ++m_additions >= m_sampleSize)
+    age();
+}
+
+int FrequencySketch::Frequency(uint64_t key) const
+{
+  int frequency = SKETCH_MAX_COUNT;
+  for (int row = 0; row < SKETCH_DEPTH; ++row)
+  {
+    uint64_t h = hash(key, row);
+    int count = (int)((m_table[h & m_mask] >> ((h >> 60) << 2)) & SKETCH_MAX_COUNT);
+    if (count < frequency)
+      frequency = count;
+  }
+  return frequency;
+}
+
+void FrequencySketch::age()
+{
+  // halves every counter of a word at once, the bits shifted into a neighbour are masked off
+  for (int64_t i = 0; i <= m_mask; ++i)
+    m_table[i] = (m_table[i] >> 1) & 0x7777777777777777ULL;
+  m_additions /= 2;
+}
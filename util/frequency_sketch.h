@@ -0,0 +1,33 @@
+#ifndef _FREQUENCY_SKETCH_H_
+#define _FREQUENCY_SKETCH_H_
+
+#include <stdint.h>
+
+#define SKETCH_DEPTH       4   // counters a key is spread over, its frequency is the smallest
+#define SKETCH_MAX_COUNT   15  // 4 bit counters
+#define SKETCH_SAMPLE_RATE 10  // increments per tracked key before the counters are halved
+
+// approximate access counts of recent keys for a cache admission policy, a count-min sketch of
+// 4 bit counters. the counters are halved every sample period, so old popularity fades.
+class FrequencySketch
+{
+public:
+  // sized for about capacity distinct keys
+  explicit FrequencySketch(int32_t capacity);
+  ~FrequencySketch();
+
+  void Increment(uint64_t key);
+  int Frequency(uint64_t key) const;
+  void Clear();
+
+private:
+  static uint64_t hash(uint64_t key, int row);
+  void age();
+
+  uint64_t* m_table;  // 16 counters per word
+  int64_t m_mask;     // words - 1
+  int64_t m_additions;
+  int64_t m_sampleSize;
+};
+
+#endif  //! #ifndef _FREQUENCY_SKETCH_H_
@@ -0,0 +1,206 @@
+#include "io_ring.h"
+#include <stdlib.h>
+
+#ifdef USE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+# include <unistd.h>
+# include <errno.h>
+# include <string.h>
+#endif
+
+IoRing::IoRing()
+{
+  m_fd = -1;
+  m_sqRing = m_cqRing = m_sqes = m_cqes = nullptr;
+  m_sqRingBytes = m_cqRingBytes = m_sqesBytes = 0;
+  m_sqHead = m_sqTail = m_sqMask = m_sqArray = nullptr;
+  m_cqHead = m_cqTail = m_cqMask = nullptr;
+  m_entries = 0;
+  m_queued = 0;
+  m_inFlight = 0;
+  m_buffer = nullptr;
+  m_bufferBytes = 0;
+  m_registered = false;
+}
+
+#ifdef USE_IO_URING
+IoRing* IoRing::Create(unsigned entries, int bufferBytes)
+{
+  IoRing* ring = new IoRing();
+  if (ring->setup(entries, bufferBytes))
+    return ring;
+  delete ring;
+  return nullptr;
+}
+#else
+IoRing* IoRing::Create(unsigned, int)
+{
+  return nullptr;
+}
+#endif
+
+IoRing::~IoRing()
+{
+#ifdef USE_IO_URING
+  if (m_sqes)
+    munmap(m_sqes, m_sqesBytes);
+  if (m_cqRing && m_cqRing != m_sqRing)
+    munmap(m_cqRing, m_cqRingBytes);
+  if (m_sqRing)
+    munmap(m_sqRing, m_sqRingBytes);
+  if (m_fd >= 0)
+    close(m_fd);
+#endif
+  free(m_buffer);
+}
+
+char* IoRing::Buffer(int size)
+{
+  return size <= m_bufferBytes ? m_buffer : nullptr;
+}
+
+#ifdef USE_IO_URING
+
+bool IoRing::setup(unsigned entries, int bufferBytes)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0)
+    return false;
+
+  m_sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single)
+    m_sqRingBytes = m_cqRingBytes = m_sqRingBytes > m_cqRingBytes ? m_sqRingBytes : m_cqRingBytes;
+
+  m_sqRing = mmap(nullptr, m_sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_sqRing == MAP_FAILED)
+  {
+    m_sqRing = nullptr;
+    return false;
+  }
+  m_cqRing = single ? m_sqRing : mmap(nullptr, m_cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+  if (m_cqRing == MAP_FAILED)
+  {
+    m_cqRing = nullptr;
+    return false;
+  }
+  m_sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  m_sqes = mmap(nullptr, m_sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+  if (m_sqes == MAP_FAILED)
+  {
+    m_sqes = nullptr;
+    return false;
+  }
+
+  char* sq = (char*)m_sqRing;
+  m_sqHead = (unsigned*)(sq + params.sq_off.head);
+  m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+  m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+  m_sqArray = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)m_cqRing;
+  m_cqHead = (unsigned*)(cq + params.cq_off.head);
+  m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+  m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+  m_cqes = cq + params.cq_off.cqes;
+  m_entries = params.sq_entries;
+
+  // the registration counts against the locked memory limit, reads into an unregistered buffer still work
+  if (bufferBytes > 0 && posix_memalign((void**)&m_buffer, 4096, bufferBytes) == 0)
+  {
+    m_bufferBytes = bufferBytes;
+    struct iovec iov;
+    iov.iov_base = m_buffer;
+    iov.iov_len = bufferBytes;
+    m_registered = syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  }
+  return true;
+}
+
+bool IoRing::Prepare(int fd, FileRequest* request)
+{
+  unsigned tail = *m_sqTail;
+  unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+  if (m_fd < 0 || tail - head >= m_entries || m_queued + m_inFlight >= m_entries)
+    return false;
+
+  unsigned index = tail & *m_sqMask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)m_sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  bool fixed = m_registered && request->data >= m_buffer && request->data + request->size <= m_buffer + m_bufferBytes;
+  sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = request->offset;
+  sqe->addr = (uint64_t)(uintptr_t)request->data;
+  sqe->len = request->size;
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)(uintptr_t)request;
+  m_sqArray[index] = index;
+  __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++m_queued;
+  return true;
+}
+
+void IoRing::reap()
+{
+  unsigned head = *m_cqHead;
+  unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head)
+  {
+    struct io_uring_cqe* cqe = (struct io_uring_cqe*)m_cqes + (head & *m_cqMask);
+    FileRequest* request = (FileRequest*)(uintptr_t)cqe->user_data;
+    request->result = cqe->res < 0 ? -1 : cqe->res;
+    --m_inFlight;
+  }
+  __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+}
+
+int IoRing::Run()
+{
+  int completed = m_queued + m_inFlight;
+  while (m_queued + m_inFlight > 0)
+  {
+    int ret = syscall(__NR_io_uring_enter, m_fd, m_queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      // queued entries would be submitted by a later call with their buffers gone
+      close(m_fd);
+      m_fd = -1;
+      return -1;
+    }
+    m_queued -= ret;
+    m_inFlight += ret;
+    reap();
+  }
+  return completed;
+}
+
+#else
+
+bool IoRing::setup(unsigned, int)
+{
+  return false;
+}
+
+bool IoRing::Prepare(int, FileRequest*)
+{
+  return false;
+}
+
+void IoRing::reap()
+{
+}
+
+int IoRing::Run()
+{
+  return -1;
+}
+
+#endif
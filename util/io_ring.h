@@ -0,0 +1,65 @@
+#ifndef _IO_RING_H_
+#define _IO_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// one read of File::ReadBatch
+struct FileRequest
+{
+  int64_t offset;
+  char* data;
+  int size;
+  int result;  // bytes read, -1 on error
+};
+
+// a Linux io_uring for batches of reads, built with USE_IO_URING. Create returns null when it is
+// not built in or the kernel refuses it, File::ReadBatch then reads synchronously. a ring is not
+// thread safe, its owner serializes the batches.
+class IoRing
+{
+public:
+  static IoRing* Create(unsigned entries, int bufferBytes);
+  ~IoRing();
+
+  // memory registered with the kernel, reads into it skip the per request page pinning.
+  // null when size does not fit
+  char* Buffer(int size);
+
+  // queues a read, false when the submission queue is full
+  bool Prepare(int fd, FileRequest* request);
+  // submits the queued reads and waits until every one of them completed, -1 when the ring broke
+  int Run();
+
+  bool IsValid() const { return m_fd >= 0; }
+
+private:
+  IoRing();
+  bool setup(unsigned entries, int bufferBytes);
+  void reap();
+
+  int m_fd;
+  void* m_sqRing;
+  void* m_cqRing;
+  void* m_sqes;  // io_uring_sqe
+  void* m_cqes;  // io_uring_cqe
+  size_t m_sqRingBytes;
+  size_t m_cqRingBytes;
+  size_t m_sqesBytes;
+  unsigned* m_sqHead;
+  unsigned* m_sqTail;
+  unsigned* m_sqMask;
+  unsigned* m_sqArray;
+  unsigned* m_cqHead;
+  unsigned* m_cqTail;
+  unsigned* m_cqMask;
+  unsigned m_entries;
+  unsigned m_queued;    // prepared, not submitted yet
+  unsigned m_inFlight;  // submitted, not completed yet
+
+  char* m_buffer;
+  int m_bufferBytes;
+  bool m_registered;
+};
+
+#endif  //! #ifndef _IO_RING_H_